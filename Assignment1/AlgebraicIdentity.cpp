@@ -21,8 +21,15 @@
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/ADT/Statistic.h"
 
 using namespace llvm;
+using namespace llvm::PatternMatch;
+
+#define DEBUG_TYPE "algebraic-identity"
 
 //-----------------------------------------------------------------------------
 // TestPass implementation
@@ -32,75 +39,108 @@ using namespace llvm;
 namespace {
 
 
+// una regola di riscrittura: se l'istruzione ha opcode Opcode e i suoi operandi (X, Y)
+// soddisfano Match, l'istruzione viene sostituita dal valore ritornato da Match.
+// Per gli opcode commutativi la regola viene provata anche con gli operandi scambiati,
+// quindi basta scrivere una sola forma (es. x+0 copre anche 0+x).
+// Hits conta quante volte la regola è stata applicata (visibile con opt -stats)
+struct IdentityRule {
+  unsigned Opcode;
+  Value *(*Match)(Value *X, Value *Y, BinaryOperator &I);
+  TrackingStatistic Hits;
+};
+
+// tabella delle identità algebriche: una nuova identità è una nuova riga
+IdentityRule Rules[] = {
+  // aritmetica intera
+  {Instruction::Add,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? X : nullptr; }, {DEBUG_TYPE, "AddZero", "x + 0 -> x"}},
+  {Instruction::Sub,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? X : nullptr; }, {DEBUG_TYPE, "SubZero", "x - 0 -> x"}},
+  {Instruction::Sub,  [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return X == Y ? Constant::getNullValue(I.getType()) : nullptr; }, {DEBUG_TYPE, "SubSelf", "x - x -> 0"}},
+  {Instruction::Mul,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_One()) ? X : nullptr; }, {DEBUG_TYPE, "MulOne", "x * 1 -> x"}},
+  {Instruction::Mul,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? Y : nullptr; }, {DEBUG_TYPE, "MulZero", "x * 0 -> 0"}},
+  {Instruction::SDiv, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_One()) ? X : nullptr; }, {DEBUG_TYPE, "SDivOne", "x /s 1 -> x"}},
+  {Instruction::UDiv, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_One()) ? X : nullptr; }, {DEBUG_TYPE, "UDivOne", "x /u 1 -> x"}},
+  {Instruction::SRem, [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return match(Y, m_One()) ? Constant::getNullValue(I.getType()) : nullptr; }, {DEBUG_TYPE, "SRemOne", "x %s 1 -> 0"}},
+  {Instruction::URem, [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return match(Y, m_One()) ? Constant::getNullValue(I.getType()) : nullptr; }, {DEBUG_TYPE, "URemOne", "x %u 1 -> 0"}},
+  // operazioni bit a bit
+  {Instruction::And,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_AllOnes()) ? X : nullptr; }, {DEBUG_TYPE, "AndAllOnes", "x & -1 -> x"}},
+  {Instruction::And,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? Y : nullptr; }, {DEBUG_TYPE, "AndZero", "x & 0 -> 0"}},
+  {Instruction::And,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return X == Y ? X : nullptr; }, {DEBUG_TYPE, "AndSelf", "x & x -> x"}},
+  {Instruction::Or,   [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? X : nullptr; }, {DEBUG_TYPE, "OrZero", "x | 0 -> x"}},
+  {Instruction::Or,   [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_AllOnes()) ? Y : nullptr; }, {DEBUG_TYPE, "OrAllOnes", "x | -1 -> -1"}},
+  {Instruction::Or,   [](Value *X, Value *Y, BinaryOperator &) -> Value * { return X == Y ? X : nullptr; }, {DEBUG_TYPE, "OrSelf", "x | x -> x"}},
+  {Instruction::Xor,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? X : nullptr; }, {DEBUG_TYPE, "XorZero", "x ^ 0 -> x"}},
+  {Instruction::Xor,  [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return X == Y ? Constant::getNullValue(I.getType()) : nullptr; }, {DEBUG_TYPE, "XorSelf", "x ^ x -> 0"}},
+  {Instruction::Shl,  [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? X : nullptr; }, {DEBUG_TYPE, "ShlZero", "x << 0 -> x"}},
+  {Instruction::LShr, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? X : nullptr; }, {DEBUG_TYPE, "LShrZero", "x >>u 0 -> x"}},
+  {Instruction::AShr, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_Zero()) ? X : nullptr; }, {DEBUG_TYPE, "AShrZero", "x >>s 0 -> x"}},
+  // virgola mobile: le identità valgono sempre solo con lo zero del segno giusto,
+  // le altre richiedono i flag fast-math nsz/nnan
+  {Instruction::FAdd, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_NegZeroFP()) ? X : nullptr; }, {DEBUG_TYPE, "FAddNegZero", "x + -0.0 -> x"}},
+  {Instruction::FAdd, [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return I.hasNoSignedZeros() && match(Y, m_AnyZeroFP()) ? X : nullptr; }, {DEBUG_TYPE, "FAddZeroNSZ", "x + 0.0 -> x (nsz)"}},
+  {Instruction::FSub, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_PosZeroFP()) ? X : nullptr; }, {DEBUG_TYPE, "FSubPosZero", "x - 0.0 -> x"}},
+  {Instruction::FSub, [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return I.hasNoSignedZeros() && match(Y, m_AnyZeroFP()) ? X : nullptr; }, {DEBUG_TYPE, "FSubZeroNSZ", "x - -0.0 -> x (nsz)"}},
+  {Instruction::FSub, [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return I.hasNoNaNs() && X == Y ? Constant::getNullValue(I.getType()) : nullptr; }, {DEBUG_TYPE, "FSubSelfNNaN", "x - x -> 0.0 (nnan)"}},
+  {Instruction::FMul, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_FPOne()) ? X : nullptr; }, {DEBUG_TYPE, "FMulOne", "x * 1.0 -> x"}},
+  {Instruction::FMul, [](Value *X, Value *Y, BinaryOperator &I) -> Value * { return I.hasNoNaNs() && I.hasNoSignedZeros() && match(Y, m_AnyZeroFP()) ? Constant::getNullValue(I.getType()) : nullptr; }, {DEBUG_TYPE, "FMulZeroNNaNNSZ", "x * 0.0 -> 0.0 (nnan nsz)"}},
+  {Instruction::FDiv, [](Value *X, Value *Y, BinaryOperator &) -> Value * { return match(Y, m_FPOne()) ? X : nullptr; }, {DEBUG_TYPE, "FDivOne", "x / 1.0 -> x"}},
+};
+
+// data un'istruzione, se una regola della tabella si applica ritorna il valore con cui
+// sostituirla, altrimenti nullptr
+Value *simplifyIdentity(Instruction &Instr) {
+  auto *BO = dyn_cast<BinaryOperator>(&Instr);
+  if (!BO)
+    return nullptr;
+  Value *Op0 = BO->getOperand(0);
+  Value *Op1 = BO->getOperand(1);
+  bool Commutative = Instruction::isCommutative(BO->getOpcode());
+  for (IdentityRule &R : Rules) {
+    if (R.Opcode != BO->getOpcode())
+      continue;
+    Value *Repl = R.Match(Op0, Op1, *BO);
+    if (!Repl && Commutative)
+      Repl = R.Match(Op1, Op0, *BO);
+    if (Repl) {
+      ++R.Hits;
+      return Repl;
+    }
+  }
+  return nullptr;
+}
+
 // New PM implementation
 struct AlgebraicIdentity: PassInfoMixin<AlgebraicIdentity> {
   // Main entry point, takes IR unit to run the pass on (&F) and the
   // corresponding pass manager (to be queried if need be)
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
-    // il booleano changes serve per capire se ci sono stati cambiamenti e in caso positivo abilita nuovamente il while
-    // per controllare se ci sono altre ottimizzazioni da fare
-    bool changes = false;
-    // mentre anyChanges tiene conto di ogni modifica
+    // anyChanges tiene conto di ogni modifica
     bool anyChanges = false;
-    // ciclo for che scorre tutti i blocchi base della funzione
-    for(auto B = F.begin(), BE = F.end(); B != BE; ++B) {
-      BasicBlock &BB = *B;
-      do{
-        changes = false;
-        //ciclo for che scorre tutte le istruzioni del blocco base
-        for(auto I = BB.begin(), IE = BB.end(); I != IE; ++I) {
-          Instruction &Instr = *I;
-          //se l'istruzione è una somma controllo se il secondo operando è 0
-          //se è vero allora sostituisco la somma con il primo operando
-          if(Instr.getOpcode() == Instruction::Add) {
-            if(auto *Op1 = dyn_cast<ConstantInt>(Instr.getOperand(1))) {
-              if(Op1->isZero()) {
-                Instr.replaceAllUsesWith(Instr.getOperand(0));
-                Instr.eraseFromParent();
-                changes = true;
-                anyChanges = true;
-                break;
-              }
-            }
-          //se l'istruzione è una moltiplicazione controllo se il secondo operando è 1
-          //se è vero allora sostituisco la moltiplicazione con il primo operando
-          } else if (Instr.getOpcode() == Instruction::Mul){
-            if(auto *Op1 = dyn_cast<ConstantInt>(Instr.getOperand(1))) {
-              if(Op1->isOne()) {
-                Instr.replaceAllUsesWith(Instr.getOperand(0));
-                Instr.eraseFromParent();
-                changes = true;
-                anyChanges = true;
-                break;
-              }
-            }
-          //se l'istruzione è una sottrazione controllo se il secondo operando è 0
-          //se è vero allora sostituisco la sottrazione con il primo operando
-          }  else if (Instr.getOpcode() == Instruction::Sub){
-            if(auto *Op1 = dyn_cast<ConstantInt>(Instr.getOperand(1))) {
-              if(Op1->isZero()) {
-                Instr.replaceAllUsesWith(Instr.getOperand(0));
-                Instr.eraseFromParent();
-                changes = true;
-                anyChanges = true;
-                break;
-              }
-            }
-          //se l'istruzione è una divisione controllo se il secondo operando è 1
-          //se è vero allora sostituisco la divisione con il primo operando
-          } else if (Instr.getOpcode() == Instruction::SDiv){
-            if(auto *Op1 = dyn_cast<ConstantInt>(Instr.getOperand(1))) {
-              if(Op1->isOne()) {
-                Instr.replaceAllUsesWith(Instr.getOperand(0));
-                Instr.eraseFromParent();
-                changes = true;
-                anyChanges = true;
-                break;
-              }
-            }
-          }
-        }
-      }while(changes);
+    // worklist con tutte le istruzioni della funzione: ogni istruzione viene visitata
+    // una sola volta, e solo gli user di un'istruzione eliminata vengono rimessi in lista.
+    // I WeakVH diventano nulli se l'istruzione puntata viene eliminata nel frattempo
+    SmallVector<WeakVH, 64> Worklist;
+    for (Instruction &Instr : instructions(F))
+      Worklist.push_back(&Instr);
+    // la lista viene consumata dal fondo, quindi la si inverte per visitare
+    // le istruzioni nell'ordine del programma
+    std::reverse(Worklist.begin(), Worklist.end());
+
+    while (!Worklist.empty()) {
+      auto *Instr = dyn_cast_or_null<Instruction>(Worklist.pop_back_val());
+      if (!Instr)
+        continue;
+      Value *Repl = simplifyIdentity(*Instr);
+      if (!Repl)
+        continue;
+      // gli user dell'istruzione eliminata potrebbero diventare a loro volta
+      // semplificabili, quindi vengono rimessi nella worklist
+      for (User *U : Instr->users())
+        if (auto *UI = dyn_cast<Instruction>(U))
+          Worklist.push_back(UI);
+      Instr->replaceAllUsesWith(Repl);
+      Instr->eraseFromParent();
+      anyChanges = true;
     }
     if(anyChanges){
       PreservedAnalyses PA;
@@ -0,0 +1,312 @@
+//=============================================================================
+// FILE:
+//    GlobalValueNumbering.cpp
+//
+// DESCRIPTION:
+//    Global value numbering basata sul dominator tree: le espressioni pure
+//    (operazioni binarie, cast, confronti, GEP, select) ricalcolate in un blocco
+//    dominato vengono sostituite dalla prima occorrenza. Le load ridondanti
+//    vengono eliminate tramite MemorySSA (stesso indirizzo e stesso clobber, oppure
+//    store precedente allo stesso indirizzo) e sui diamanti viene fatta una
+//    partial redundancy elimination con l'inserimento di una phi nel blocco di join.
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libGlobalValueNumbering.so -passes="gvn-pass" `\`
+//        -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/ADT/Hashing.h"
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// GlobalValueNumbering implementation
+//-----------------------------------------------------------------------------
+// No need to expose the internals of the pass to the outside world - keep
+// everything in an anonymous namespace.
+namespace {
+
+// istruzioni pure che possono essere numerate: stesso insieme di istruzioni
+// "sicure" usato dalla LICM
+bool isNumberable(Instruction *I) {
+  return isa<BinaryOperator>(I) || isa<CastInst>(I) || isa<SelectInst>(I) ||
+         isa<GetElementPtrInst>(I) || isa<CmpInst>(I);
+}
+
+// informazioni per usare un'istruzione come chiave strutturale nelle tabelle hash:
+// due istruzioni sono uguali se calcolano la stessa espressione sugli stessi operandi
+// (a meno di commutatività e dei flag nsw/nuw/exact/inbounds)
+struct ExprInfo {
+  static Instruction *getEmptyKey() { return DenseMapInfo<Instruction *>::getEmptyKey(); }
+  static Instruction *getTombstoneKey() { return DenseMapInfo<Instruction *>::getTombstoneKey(); }
+
+  static unsigned getHashValue(const Instruction *I) {
+    Value *LHS = I->getNumOperands() > 0 ? I->getOperand(0) : nullptr;
+    Value *RHS = I->getNumOperands() > 1 ? I->getOperand(1) : nullptr;
+    // gli operandi delle operazioni commutative e dei confronti vengono ordinati,
+    // per i confronti il predicato viene scambiato di conseguenza
+    if (auto *Cmp = dyn_cast<CmpInst>(I)) {
+      CmpInst::Predicate Pred = Cmp->getPredicate();
+      if (std::less<Value *>()(RHS, LHS)) {
+        std::swap(LHS, RHS);
+        Pred = Cmp->getSwappedPredicate();
+      }
+      return hash_combine(I->getOpcode(), Pred, LHS, RHS);
+    }
+    if (I->isCommutative() && std::less<Value *>()(RHS, LHS))
+      std::swap(LHS, RHS);
+    if (I->getNumOperands() <= 2)
+      return hash_combine(I->getOpcode(), I->getType(), LHS, RHS);
+    return hash_combine(I->getOpcode(), I->getType(),
+                        hash_combine_range(I->value_op_begin(), I->value_op_end()));
+  }
+
+  static bool isEqual(const Instruction *LHS, const Instruction *RHS) {
+    if (LHS == RHS)
+      return true;
+    if (LHS == getEmptyKey() || LHS == getTombstoneKey() ||
+        RHS == getEmptyKey() || RHS == getTombstoneKey())
+      return false;
+    if (LHS->getOpcode() != RHS->getOpcode() || LHS->getType() != RHS->getType())
+      return false;
+    if (LHS->isIdenticalToWhenDefined(RHS))
+      return true;
+    if (LHS->isCommutative())
+      return LHS->getOperand(0) == RHS->getOperand(1) &&
+             LHS->getOperand(1) == RHS->getOperand(0);
+    if (auto *LCmp = dyn_cast<CmpInst>(LHS)) {
+      auto *RCmp = cast<CmpInst>(RHS);
+      return LCmp->getPredicate() == RCmp->getSwappedPredicate() &&
+             LHS->getOperand(0) == RHS->getOperand(1) &&
+             LHS->getOperand(1) == RHS->getOperand(0);
+    }
+    return false;
+  }
+};
+
+// chiave per le load: (indirizzo, tipo caricato, accesso in memoria che le fa da clobber)
+using LoadKey = std::tuple<Value *, Type *, MemoryAccess *>;
+
+using ExprTable = ScopedHashTable<Instruction *, Instruction *, ExprInfo>;
+using ExprScope = ScopedHashTableScope<Instruction *, Instruction *, ExprInfo>;
+using LoadTable = ScopedHashTable<LoadKey, Value *>;
+using LoadScope = ScopedHashTableScope<LoadKey, Value *>;
+
+struct ValueNumbering {
+  DominatorTree &DT;
+  MemorySSA &MSSA;
+  MemorySSAUpdater MSSAU;
+  // espressioni e load disponibili: le tabelle sono a scope e seguono il dominator
+  // tree, quindi contengono solo valori che dominano il punto corrente
+  ExprTable AvailableExprs;
+  LoadTable AvailableLoads;
+
+  ValueNumbering(DominatorTree &DT, MemorySSA &MSSA) : DT(DT), MSSA(MSSA), MSSAU(&MSSA) {}
+
+  // sostituisce I con V ed elimina I, tenendo aggiornata MemorySSA
+  void replace(Instruction *I, Value *V) {
+    // i flag di V (nsw, nuw, exact, inbounds...) devono valere anche dove c'era I
+    if (auto *VI = dyn_cast<Instruction>(V))
+      if (VI->getOpcode() == I->getOpcode())
+        VI->andIRFlags(I);
+    I->replaceAllUsesWith(V);
+    MSSAU.removeMemoryAccess(I);
+    I->eraseFromParent();
+  }
+
+  // per una load semplice ritorna il valore già disponibile in memoria, se c'è: quello di
+  // una load precedente con stesso indirizzo e stesso clobber, oppure quello scritto dalla
+  // store che le fa da clobber se scrive esattamente lo stesso indirizzo e tipo
+  Value *findAvailableLoad(LoadInst *L) {
+    if (!L->isSimple())
+      return nullptr;
+    MemoryAccess *Clobber = MSSA.getWalker()->getClobberingMemoryAccess(L);
+    if (auto *Def = dyn_cast<MemoryDef>(Clobber))
+      if (auto *S = dyn_cast_or_null<StoreInst>(Def->getMemoryInst()))
+        if (S->isSimple() && S->getPointerOperand() == L->getPointerOperand() &&
+            S->getValueOperand()->getType() == L->getType())
+          return S->getValueOperand();
+    LoadKey Key = {L->getPointerOperand(), L->getType(), Clobber};
+    if (Value *V = AvailableLoads.lookup(Key))
+      return V;
+    AvailableLoads.insert(Key, L);
+    return nullptr;
+  }
+
+  // una sola passata sulle istruzioni del blocco: ogni espressione già calcolata in un
+  // blocco dominante viene sostituita, le altre diventano disponibili per i blocchi dominati
+  bool processBlock(BasicBlock &BB) {
+    bool Changed = false;
+    for (Instruction &Instr : make_early_inc_range(BB)) {
+      Value *Avail = nullptr;
+      if (auto *L = dyn_cast<LoadInst>(&Instr)) {
+        Avail = findAvailableLoad(L);
+      } else if (isNumberable(&Instr)) {
+        Avail = AvailableExprs.lookup(&Instr);
+        if (!Avail)
+          AvailableExprs.insert(&Instr, &Instr);
+      }
+      if (Avail) {
+        replace(&Instr, Avail);
+        Changed = true;
+      }
+    }
+    return Changed;
+  }
+
+  // visita il dominator tree in preordine con uno stack esplicito; ogni nodo apre uno
+  // scope delle tabelle che viene chiuso quando tutti i figli sono stati visitati
+  bool run() {
+    struct StackNode {
+      DomTreeNode *Node;
+      DomTreeNode::const_iterator ChildIt;
+      ExprScope Exprs;
+      LoadScope Loads;
+      StackNode(ValueNumbering &VN, DomTreeNode *N)
+          : Node(N), ChildIt(N->begin()), Exprs(VN.AvailableExprs), Loads(VN.AvailableLoads) {}
+    };
+    bool Changed = false;
+    SmallVector<std::unique_ptr<StackNode>, 16> Stack;
+    Stack.push_back(std::make_unique<StackNode>(*this, DT.getRootNode()));
+    Changed |= processBlock(*DT.getRootNode()->getBlock());
+    while (!Stack.empty()) {
+      StackNode &Top = *Stack.back();
+      if (Top.ChildIt == Top.Node->end()) {
+        Stack.pop_back();
+        continue;
+      }
+      DomTreeNode *Child = *Top.ChildIt++;
+      Stack.push_back(std::make_unique<StackNode>(*this, Child));
+      Changed |= processBlock(*Child->getBlock());
+    }
+    return Changed;
+  }
+
+  // partial redundancy elimination sui diamanti: se un'espressione del blocco di join è
+  // già calcolata in uno dei due predecessori, viene calcolata anche nell'altro e
+  // l'istruzione del join è sostituita da una phi. I predecessori devono avere il join
+  // come unico successore, così la copia non viene eseguita su percorsi che non la usavano
+  bool performDiamondPRE(Function &F) {
+    bool Changed = false;
+    for (BasicBlock &Join : F) {
+      BasicBlock *Preds[2] = {nullptr, nullptr};
+      unsigned NumPreds = 0;
+      for (BasicBlock *Pred : predecessors(&Join)) {
+        if (NumPreds == 2 || Pred->getSingleSuccessor() != &Join) {
+          NumPreds = 3;
+          break;
+        }
+        Preds[NumPreds++] = Pred;
+      }
+      if (NumPreds != 2 || Preds[0] == Preds[1] || !DT.isReachableFromEntry(&Join))
+        continue;
+
+      // espressioni calcolate in ciascuno dei due predecessori
+      DenseMap<Instruction *, Instruction *, ExprInfo> AvailOut[2];
+      for (unsigned k = 0; k < 2; ++k)
+        for (Instruction &I : *Preds[k])
+          if (isNumberable(&I))
+            AvailOut[k].insert({&I, &I});
+
+      for (Instruction &Instr : make_early_inc_range(Join)) {
+        if (!isNumberable(&Instr) || !isSafeToSpeculativelyExecute(&Instr))
+          continue;
+        // gli operandi devono essere disponibili in entrambi i predecessori
+        bool OperandsAvailable = all_of(Instr.operands(), [&](Use &U) {
+          auto *OpI = dyn_cast<Instruction>(U.get());
+          return !OpI || DT.properlyDominates(OpI->getParent(), &Join);
+        });
+        if (!OperandsAvailable)
+          continue;
+        Instruction *Avail[2] = {AvailOut[0].lookup(&Instr), AvailOut[1].lookup(&Instr)};
+        if (!Avail[0] && !Avail[1])
+          continue;
+        for (unsigned k = 0; k < 2; ++k) {
+          if (Avail[k]) {
+            Avail[k]->andIRFlags(&Instr);
+            continue;
+          }
+          Avail[k] = Instr.clone();
+          Avail[k]->insertBefore(Preds[k]->getTerminator());
+          AvailOut[k].insert({Avail[k], Avail[k]});
+        }
+        IRBuilder<> Builder(&Join, Join.begin());
+        PHINode *Phi = Builder.CreatePHI(Instr.getType(), 2);
+        Phi->addIncoming(Avail[0], Preds[0]);
+        Phi->addIncoming(Avail[1], Preds[1]);
+        Phi->takeName(&Instr);
+        Instr.replaceAllUsesWith(Phi);
+        Instr.eraseFromParent();
+        Changed = true;
+      }
+    }
+    return Changed;
+  }
+};
+
+// New PM implementation
+struct GlobalValueNumbering: PassInfoMixin<GlobalValueNumbering> {
+  // Main entry point, takes IR unit to run the pass on (&F) and the
+  // corresponding pass manager (to be queried if need be)
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    MemorySSA &MSSA = AM.getResult<MemorySSAAnalysis>(F).getMSSA();
+    ValueNumbering VN(DT, MSSA);
+    // prima si eliminano le ridondanze totali, poi quelle parziali sui diamanti
+    bool anyChanges = VN.run();
+    anyChanges |= VN.performDiamondPRE(F);
+    if(anyChanges){
+      PreservedAnalyses PA;
+      PA.preserve<DominatorTreeAnalysis>();  // CFG non modificato
+      PA.preserve<LoopAnalysis>();           // Loops non toccati
+      PA.preserve<MemorySSAAnalysis>();      // aggiornata durante le eliminazioni
+      return PA;
+    } else return PreservedAnalyses::all();
+}
+
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "GlobalValueNumbering", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "gvn-pass") {
+                    FPM.addPass(GlobalValueNumbering());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize GlobalValueNumbering when added to the pass pipeline on
+// the command line, i.e. via '-passes=gvn-pass'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
@@ -21,6 +21,8 @@
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/ADT/ScopedHashTable.h"
 
 using namespace llvm;
 
@@ -32,49 +34,148 @@ using namespace llvm;
 namespace {
 
 
+// chiave della tabella delle espressioni disponibili: (opcode, operando 0, operando 1).
+// Per la somma gli operandi vengono ordinati, così a+b e b+a hanno la stessa chiave
+using ExprKey = std::tuple<unsigned, Value *, Value *>;
+using ExprTable = ScopedHashTable<ExprKey, Value *>;
+using ExprScope = ScopedHashTableScope<ExprKey, Value *>;
+
+ExprKey getExprKey(unsigned Opcode, Value *LHS, Value *RHS) {
+  if (Instruction::isCommutative(Opcode) && std::less<Value *>()(RHS, LHS))
+    std::swap(LHS, RHS);
+  return {Opcode, LHS, RHS};
+}
+
+// profondità massima delle catene di somme/sottrazioni esplorate per ogni istruzione,
+// così la passata resta lineare
+const unsigned MaxChainDepth = 8;
+
+struct AddSubCanceller {
+  // espressioni add/sub disponibili nel blocco corrente: la tabella è a scope e segue
+  // il dominator tree, quindi contiene solo istruzioni che dominano il punto corrente
+  ExprTable AvailableExprs;
+  // istruzioni create durante le cancellazioni, che alla fine potrebbero essere morte
+  SmallVector<WeakTrackingVH, 16> NewInsts;
+
+  // ritorna un'istruzione Opcode(LHS, RHS) disponibile, altrimenti la crea prima di InsertPt
+  Value *getOrCreate(unsigned Opcode, Value *LHS, Value *RHS, Instruction *InsertPt) {
+    ExprKey Key = getExprKey(Opcode, LHS, RHS);
+    if (Value *V = AvailableExprs.lookup(Key))
+      return V;
+    auto *NewI = BinaryOperator::Create(static_cast<Instruction::BinaryOps>(Opcode), LHS, RHS, "", InsertPt);
+    AvailableExprs.insert(Key, NewI);
+    NewInsts.push_back(NewI);
+    return NewI;
+  }
+
+  // cerca di calcolare X - B (IsSub) oppure X + B (!IsSub) cancellando B con un termine
+  // opposto all'interno della catena di somme e sottrazioni che definisce X.
+  // Se B non si cancella con nessun termine ritorna nullptr senza creare istruzioni
+  Value *cancel(Value *X, Value *B, bool IsSub, Instruction *InsertPt, unsigned Depth) {
+    auto *BinOp = dyn_cast<BinaryOperator>(X);
+    if (!BinOp || Depth > MaxChainDepth)
+      return nullptr;
+    Value *P = BinOp->getOperand(0);
+    Value *Q = BinOp->getOperand(1);
+    if (BinOp->getOpcode() == Instruction::Add) {
+      // (P + B) - B = P e (B + Q) - B = Q
+      if (IsSub && Q == B)
+        return P;
+      if (IsSub && P == B)
+        return Q;
+      // (P + Q) +- B = (P +- B) + Q, oppure P + (Q +- B)
+      if (Value *R = cancel(P, B, IsSub, InsertPt, Depth + 1))
+        return getOrCreate(Instruction::Add, R, Q, InsertPt);
+      if (Value *R = cancel(Q, B, IsSub, InsertPt, Depth + 1))
+        return getOrCreate(Instruction::Add, P, R, InsertPt);
+    } else if (BinOp->getOpcode() == Instruction::Sub) {
+      // (P - B) + B = P
+      if (!IsSub && Q == B)
+        return P;
+      // (P - Q) +- B = (P +- B) - Q
+      if (Value *R = cancel(P, B, IsSub, InsertPt, Depth + 1))
+        return getOrCreate(Instruction::Sub, R, Q, InsertPt);
+    }
+    return nullptr;
+  }
+
+  // prova a cancellare l'istruzione con una somma o sottrazione che la domina.
+  // Ritorna il valore con cui sostituirla, altrimenti nullptr
+  Value *simplify(BinaryOperator &Instr) {
+    Value *Op0 = Instr.getOperand(0);
+    Value *Op1 = Instr.getOperand(1);
+    if (Instr.getOpcode() == Instruction::Sub)
+      return cancel(Op0, Op1, /*IsSub=*/true, &Instr, 0);
+    // la somma è commutativa: il termine da cancellare può essere uno qualsiasi dei due
+    if (Value *V = cancel(Op0, Op1, /*IsSub=*/false, &Instr, 0))
+      return V;
+    return cancel(Op1, Op0, /*IsSub=*/false, &Instr, 0);
+  }
+
+  // una sola passata sulle istruzioni del blocco: le somme e sottrazioni che non si
+  // cancellano diventano disponibili per i blocchi dominati
+  bool processBlock(BasicBlock &BB) {
+    bool Changed = false;
+    for (Instruction &Instr : make_early_inc_range(BB)) {
+      auto *BinOp = dyn_cast<BinaryOperator>(&Instr);
+      if (!BinOp || !BinOp->getType()->isIntOrIntVectorTy() ||
+          (BinOp->getOpcode() != Instruction::Add && BinOp->getOpcode() != Instruction::Sub))
+        continue;
+      if (Value *V = simplify(*BinOp)) {
+        Instr.replaceAllUsesWith(V);
+        Instr.eraseFromParent();
+        Changed = true;
+        continue;
+      }
+      AvailableExprs.insert(getExprKey(BinOp->getOpcode(), BinOp->getOperand(0), BinOp->getOperand(1)), BinOp);
+    }
+    return Changed;
+  }
+
+  // visita il dominator tree in preordine con uno stack esplicito (niente ricorsione
+  // sui dominator tree profondi); ogni nodo apre uno scope della tabella che viene
+  // chiuso quando tutti i figli sono stati visitati
+  bool run(DominatorTree &DT) {
+    struct StackNode {
+      DomTreeNode *Node;
+      DomTreeNode::const_iterator ChildIt;
+      ExprScope Scope;
+      StackNode(ExprTable &Table, DomTreeNode *N)
+          : Node(N), ChildIt(N->begin()), Scope(Table) {}
+    };
+    bool Changed = false;
+    SmallVector<std::unique_ptr<StackNode>, 16> Stack;
+    Stack.push_back(std::make_unique<StackNode>(AvailableExprs, DT.getRootNode()));
+    Changed |= processBlock(*DT.getRootNode()->getBlock());
+    while (!Stack.empty()) {
+      StackNode &Top = *Stack.back();
+      if (Top.ChildIt == Top.Node->end()) {
+        Stack.pop_back();
+        continue;
+      }
+      DomTreeNode *Child = *Top.ChildIt++;
+      Stack.push_back(std::make_unique<StackNode>(AvailableExprs, Child));
+      Changed |= processBlock(*Child->getBlock());
+    }
+    // le istruzioni intermedie create e poi cancellate a loro volta sono morte
+    for (WeakTrackingVH &V : reverse(NewInsts))
+      if (auto *I = dyn_cast_or_null<Instruction>(V))
+        if (I->use_empty())
+          I->eraseFromParent();
+    return Changed;
+  }
+};
+
 // New PM implementation
 struct MultiInstOptimization: PassInfoMixin<MultiInstOptimization> {
   // Main entry point, takes IR unit to run the pass on (&F) and the
   // corresponding pass manager (to be queried if need be)
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
-    // il booleano changes serve per capire se ci sono stati cambiamenti e in caso positivo abilita nuovamente il while
-    // per controllare se ci sono altre ottimizzazioni da fare
-    bool changes = false;
-    // mentre anyChanges tiene conto di ogni modifica
-    bool anyChanges = false;
-    //ci spostiamo all'interno di ogni blocco base della funzione
-    for(auto B = F.begin(), BE = F.end(); B != BE; ++B) {
-      BasicBlock &BB = *B;
-      do{
-        changes = false;
-        //scorriamo tutte le istruzioni del blocco base
-        for (auto I = BB.begin(), IE = --BB.end(); I != IE; ++I) {
-          Instruction &Instr = *I;
-          auto Next = std::next(I);
-          // scorriamo tutte le istruzioni successive per cercare le ottimizzazioni
-          while (Next != BB.end()) {
-            Instruction &InstrNext = *Next;
-            //se troviamo due istruzioni di somma e sottrazione o viceversa con gli stessi operandi
-            //possiamo sostituire la seconda istruzione con la prima
-            if (auto *BinOp1 = dyn_cast<BinaryOperator>(&Instr)) {
-              if (auto *BinOp2 = dyn_cast<BinaryOperator>(&InstrNext)) {
-                if ((BinOp1->getOpcode() == Instruction::Add && BinOp2->getOpcode() == Instruction::Sub) ||
-                    (BinOp1->getOpcode() == Instruction::Sub && BinOp2->getOpcode() == Instruction::Add)) {
-                    if (BinOp1 == BinOp2->getOperand(0) && BinOp1->getOperand(1) == BinOp2->getOperand(1)) {
-                        InstrNext.replaceAllUsesWith(BinOp1->getOperand(0));
-                        InstrNext.eraseFromParent();
-                        changes = true;
-                        anyChanges = true;
-                        break;
-                    }
-                }
-              }
-            }
-            ++Next;
-          }
-        }
-      }while(changes);
-    }
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    // se troviamo una somma e una sottrazione (o viceversa) con un operando in comune, anche
+    // in blocchi diversi purché la prima domini la seconda, sostituiamo la seconda con
+    // l'operando rimanente della prima
+    bool anyChanges = AddSubCanceller().run(DT);
     if(anyChanges){
       PreservedAnalyses PA;
       PA.preserve<DominatorTreeAnalysis>();  // CFG non modificato
@@ -0,0 +1,279 @@
+//=============================================================================
+// FILE:
+//    Reassociation.cpp
+//
+// DESCRIPTION:
+//    Riassociazione delle espressioni intere associative e commutative (add/sub,
+//    mul, and, or, xor): ogni albero di operazioni dello stesso tipo viene
+//    appiattito nella lista delle sue foglie, le costanti vengono piegate in un
+//    unico termine, i termini opposti (a + b - a, x ^ x) si cancellano e
+//    l'espressione viene ricostruita in forma canonica ordinando le foglie per rango.
+//    In questo modo AlgebraicIdentity, StrengthReduction e MultiInstOptimization
+//    trovano la costante sempre nel secondo operando, e le sottoespressioni comuni
+//    vengono scritte allo stesso modo.
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libReassociation.so -passes="reassociation" `\`
+//        -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// Reassociation implementation
+//-----------------------------------------------------------------------------
+// No need to expose the internals of the pass to the outside world - keep
+// everything in an anonymous namespace.
+namespace {
+
+// foglia di un albero di somme e sottrazioni: Value preso con segno positivo o negativo
+struct Leaf {
+  Value *V;
+  bool Negative;
+};
+
+// le costanti vere e proprie vengono piegate; le ConstantExpr e gli undef restano foglie
+bool isFoldableConstant(Value *V) {
+  return isa<Constant>(V) && !isa<ConstantExpr>(V) && !isa<UndefValue>(V);
+}
+
+struct Reassociator {
+  const DataLayout &DL;
+  // rango dei valori: costanti 0, argomenti 1..N, istruzioni in ordine di RPO dei blocchi
+  // e di posizione nel blocco, così le foglie definite prima vengono combinate per prime
+  DenseMap<Value *, uint64_t> Rank;
+
+  Reassociator(Function &F) : DL(F.getParent()->getDataLayout()) {
+    for (Argument &A : F.args())
+      Rank[&A] = A.getArgNo() + 1;
+    uint64_t BlockRank = 0;
+    for (BasicBlock *BB : ReversePostOrderTraversal<Function *>(&F)) {
+      uint64_t InstRank = (++BlockRank) << 32;
+      for (Instruction &I : *BB)
+        Rank[&I] = ++InstRank;
+    }
+  }
+
+  uint64_t getRank(Value *V) { return isFoldableConstant(V) ? 0 : Rank.lookup(V); }
+
+  // un operando è un nodo interno dell'albero se è un'operazione dello stesso tipo,
+  // nello stesso blocco e usata solo dall'albero stesso
+  bool isInteriorNode(Value *V, unsigned Opcode, BasicBlock *BB) {
+    auto *I = dyn_cast<BinaryOperator>(V);
+    if (!I || !I->hasOneUse() || I->getParent() != BB)
+      return false;
+    if (Opcode == Instruction::Add)
+      return I->getOpcode() == Instruction::Add || I->getOpcode() == Instruction::Sub;
+    return I->getOpcode() == Opcode;
+  }
+
+  // appiattisce l'albero con radice Root nella lista delle sue foglie con segno.
+  // Per somme e sottrazioni x - y viene visto come x + (-y); si usa una worklist
+  // esplicita per non ricorrere sulle catene lunghe
+  SmallVector<Leaf, 8> linearize(BinaryOperator *Root, unsigned Opcode) {
+    SmallVector<Leaf, 8> Leaves;
+    SmallVector<Leaf, 8> Worklist = {{Root, false}};
+    while (!Worklist.empty()) {
+      Leaf N = Worklist.pop_back_val();
+      auto *I = cast<BinaryOperator>(N.V);
+      bool RHSNegative = I->getOpcode() == Instruction::Sub ? !N.Negative : N.Negative;
+      Leaf Ops[2] = {{I->getOperand(0), N.Negative}, {I->getOperand(1), RHSNegative}};
+      // si visita prima l'operando sinistro, così l'ordine delle foglie segue quello del codice
+      for (Leaf &Op : reverse(Ops)) {
+        if (isInteriorNode(Op.V, Opcode, Root->getParent()))
+          Worklist.push_back(Op);
+        else
+          Leaves.push_back(Op);
+      }
+    }
+    std::reverse(Leaves.begin(), Leaves.end());
+    return Leaves;
+  }
+
+  // piega le costanti in un unico termine e cancella i termini opposti:
+  // per la somma a e -a si annullano, per lo xor x e x, per and/or i duplicati si eliminano.
+  // In C mette la costante risultante (nullptr se non ce ne sono) e lascia in Leaves
+  // solo le foglie non costanti, prima quelle positive e poi quelle sottratte, ciascun
+  // gruppo ordinato per rango. Ritorna false se le costanti non si possono piegare
+  bool simplifyLeaves(SmallVectorImpl<Leaf> &Leaves, unsigned Opcode, Type *Ty, Constant *&C) {
+    C = nullptr;
+    // molteplicità di ogni foglia non costante (negativa per i termini sottratti)
+    MapVector<Value *, int> Count;
+    for (Leaf &L : Leaves) {
+      if (isFoldableConstant(L.V)) {
+        auto *LC = cast<Constant>(L.V);
+        if (L.Negative)
+          LC = ConstantFoldBinaryOpOperands(Instruction::Sub, Constant::getNullValue(Ty), LC, DL);
+        C = C && LC ? ConstantFoldBinaryOpOperands(Opcode, C, LC, DL) : LC;
+        if (!C)
+          return false;
+        continue;
+      }
+      Count[L.V] += L.Negative ? -1 : 1;
+    }
+    Leaves.clear();
+    for (auto &Entry : Count) {
+      int N = Entry.second;
+      if (Opcode == Instruction::And || Opcode == Instruction::Or)
+        N = 1;
+      else if (Opcode == Instruction::Xor)
+        N = N % 2;
+      for (int i = 0; i < std::abs(N); ++i)
+        Leaves.push_back({Entry.first, N < 0});
+    }
+    std::stable_sort(Leaves.begin(), Leaves.end(), [&](const Leaf &A, const Leaf &B) {
+      return std::make_pair(A.Negative, getRank(A.V)) < std::make_pair(B.Negative, getRank(B.V));
+    });
+    return true;
+  }
+
+  // ricostruisce l'espressione come catena lineare ((l0 op l1) op l2) ... op C,
+  // prima i termini positivi e poi quelli sottratti
+  Value *rebuild(ArrayRef<Leaf> Leaves, Constant *C, unsigned Opcode, BinaryOperator *Root) {
+    IRBuilder<> Builder(Root);
+    Type *Ty = Root->getType();
+    // le nuove istruzioni prendono il rango della radice che sostituiscono
+    auto Emit = [&](unsigned Op, Value *LHS, Value *RHS) {
+      Value *V = Builder.CreateBinOp(static_cast<Instruction::BinaryOps>(Op), LHS, RHS);
+      if (isa<Instruction>(V))
+        Rank[V] = Rank.lookup(Root);
+      return V;
+    };
+    Value *Acc = nullptr;
+    for (const Leaf &L : Leaves) {
+      if (L.Negative) {
+        // senza termini positivi si parte dalla costante (c - a - b) o da zero (0 - a - b)
+        if (!Acc) {
+          Acc = C ? C : Constant::getNullValue(Ty);
+          C = nullptr;
+        }
+        Acc = Emit(Instruction::Sub, Acc, L.V);
+      } else {
+        Acc = Acc ? Emit(Opcode, Acc, L.V) : L.V;
+      }
+    }
+    // la costante va per ultima, tranne quando è l'elemento neutro
+    if (C && (!Acc || C != ConstantExpr::getBinOpIdentity(Opcode, Ty)))
+      Acc = Acc ? Emit(Opcode, Acc, C) : C;
+    return Acc ? Acc : ConstantExpr::getBinOpIdentity(Opcode, Ty);
+  }
+
+  // riassocia l'albero con radice Root; ritorna true se l'espressione è cambiata
+  bool reassociate(BinaryOperator *Root, unsigned Opcode) {
+    SmallVector<Leaf, 8> Leaves = linearize(Root, Opcode);
+    SmallVector<Leaf, 8> Original = Leaves;
+    Constant *C;
+    if (!simplifyLeaves(Leaves, Opcode, Root->getType(), C))
+      return false;
+    // l'espressione è già canonica se non ci sono state semplificazioni e le foglie
+    // erano già nell'ordine di rebuild: in ordine di rango con la costante in fondo,
+    // oppure in testa (zero se manca) quando tutte le foglie sono sottratte
+    SmallVector<Leaf, 8> Canonical = Leaves;
+    if (!Leaves.empty() && Leaves.front().Negative)
+      Canonical.insert(Canonical.begin(), {C ? C : Constant::getNullValue(Root->getType()), false});
+    else if (C)
+      Canonical.push_back({C, false});
+    if (Canonical.size() == Original.size() &&
+        std::equal(Canonical.begin(), Canonical.end(), Original.begin(),
+                   [](const Leaf &A, const Leaf &B) { return A.V == B.V && A.Negative == B.Negative; }))
+      return false;
+    Value *V = rebuild(Leaves, C, Opcode, Root);
+    // il nome passa solo a un'istruzione nuova, non a una foglia rimasta da sola
+    if (isa<Instruction>(V) && none_of(Leaves, [&](const Leaf &L) { return L.V == V; }))
+      V->takeName(Root);
+    Root->replaceAllUsesWith(V);
+    RecursivelyDeleteTriviallyDeadInstructions(Root);
+    return true;
+  }
+
+  // i nodi interni vengono visitati insieme al loro albero: si parte solo dalle radici,
+  // cioè dalle operazioni che non sono un nodo interno dell'albero del loro unico user
+  bool isRoot(BinaryOperator *I, unsigned Opcode) {
+    if (!I->hasOneUse())
+      return true;
+    auto *User = dyn_cast<BinaryOperator>(*I->user_begin());
+    if (!User)
+      return true;
+    unsigned UserOpcode = User->getOpcode() == Instruction::Sub ? Instruction::Add : User->getOpcode();
+    return UserOpcode != Opcode || !isInteriorNode(I, Opcode, User->getParent());
+  }
+
+  bool run(Function &F) {
+    bool Changed = false;
+    for (BasicBlock *BB : ReversePostOrderTraversal<Function *>(&F)) {
+      for (Instruction &Instr : make_early_inc_range(*BB)) {
+        auto *BinOp = dyn_cast<BinaryOperator>(&Instr);
+        if (!BinOp || !BinOp->getType()->isIntOrIntVectorTy())
+          continue;
+        if (!BinOp->isAssociative() && BinOp->getOpcode() != Instruction::Sub)
+          continue;
+        unsigned Opcode = BinOp->getOpcode() == Instruction::Sub ? Instruction::Add : BinOp->getOpcode();
+        if (isRoot(BinOp, Opcode))
+          Changed |= reassociate(BinOp, Opcode);
+      }
+    }
+    return Changed;
+  }
+};
+
+// New PM implementation
+struct Reassociation: PassInfoMixin<Reassociation> {
+  // Main entry point, takes IR unit to run the pass on (&F) and the
+  // corresponding pass manager (to be queried if need be)
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+    bool anyChanges = Reassociator(F).run(F);
+    if(anyChanges){
+      PreservedAnalyses PA;
+      PA.preserve<DominatorTreeAnalysis>();  // CFG non modificato
+      PA.preserve<LoopAnalysis>();           // Loops non toccati
+      return PA;
+    } else return PreservedAnalyses::all();
+}
+
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Reassociation", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "reassociation") {
+                    FPM.addPass(Reassociation());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize Reassociation when added to the pass pipeline on the
+// command line, i.e. via '-passes=reassociation'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
@@ -21,8 +21,15 @@
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/KnownBits.h"
 
 using namespace llvm;
+using namespace llvm::PatternMatch;
 
 //-----------------------------------------------------------------------------
 // TestPass implementation
@@ -32,96 +39,371 @@ using namespace llvm;
 namespace {
 
 
+// termine della scomposizione di una moltiplicazione: +-(x << Shift)
+struct MulTerm {
+  unsigned Shift;
+  bool Negative;
+};
+
+// scompone la costante C in forma NAF (non-adjacent form, o canonical signed digit):
+// C = somma di +-2^k senza due cifre non nulle adiacenti, che è la scrittura con il
+// minor numero di termini. La costante viene estesa di due bit per non perdere il
+// riporto; i termini con k >= larghezza del tipo valgono 0 modulo 2^W e vengono scartati,
+// quindi funziona per qualunque larghezza di intero
+SmallVector<MulTerm, 8> getNAFTerms(const APInt &C) {
+  unsigned W = C.getBitWidth();
+  APInt V = C.zext(W + 2);
+  SmallVector<MulTerm, 8> Terms;
+  for (unsigned K = 0; K < W && !V.isZero(); ++K) {
+    if (V[0]) {
+      // la cifra è +1 se V = 1 mod 4, -1 se V = 3 mod 4
+      bool Negative = V[1];
+      Terms.push_back({K, Negative});
+      if (Negative)
+        ++V;
+      else
+        --V;
+    }
+    V.lshrInPlace(1);
+  }
+  // i termini positivi vanno per primi, così la sequenza parte da una somma e non
+  // da una negazione
+  std::stable_partition(Terms.begin(), Terms.end(),
+                        [](const MulTerm &T) { return !T.Negative; });
+  return Terms;
+}
+
+// costo secondo il target della sequenza shift/add/sub che calcola x * C
+InstructionCost getTermsCost(ArrayRef<MulTerm> Terms, Type *Ty,
+                             const TargetTransformInfo &TTI) {
+  const auto CostKind = TargetTransformInfo::TCK_Latency;
+  InstructionCost Cost = 0;
+  for (unsigned i = 0; i < Terms.size(); ++i) {
+    if (Terms[i].Shift)
+      Cost += TTI.getArithmeticInstrCost(Instruction::Shl, Ty, CostKind,
+                                         {TargetTransformInfo::OK_AnyValue, TargetTransformInfo::OP_None},
+                                         {TargetTransformInfo::OK_UniformConstantValue, TargetTransformInfo::OP_None});
+    // il primo termine non costa nulla se è positivo, altrimenti serve una negazione
+    if (i > 0 || Terms[i].Negative)
+      Cost += TTI.getArithmeticInstrCost(Terms[i].Negative ? Instruction::Sub : Instruction::Add,
+                                         Ty, CostKind);
+  }
+  return Cost;
+}
+
+// data una costante vettoriale con un valore diverso in ogni lane, ritorna il vettore dei
+// log2 delle lane se sono tutte potenze di 2 (positive, se Signed), altrimenti nullptr
+Constant *getPerLaneLog2(Constant *C, bool Signed) {
+  auto *VTy = dyn_cast<FixedVectorType>(C->getType());
+  if (!VTy)
+    return nullptr;
+  SmallVector<Constant *, 8> Amounts;
+  for (unsigned i = 0, e = VTy->getNumElements(); i < e; ++i) {
+    auto *Elt = dyn_cast_or_null<ConstantInt>(C->getAggregateElement(i));
+    if (!Elt || !Elt->getValue().isPowerOf2() || (Signed && Elt->isNegative()))
+      return nullptr;
+    Amounts.push_back(ConstantInt::get(Elt->getType(), Elt->getValue().logBase2()));
+  }
+  return ConstantVector::get(Amounts);
+}
+
+// vero se secondo il target lo shift con quantità diverse per lane non costa più
+// dell'istruzione Opcode che sostituisce
+bool isPerLaneShiftProfitable(unsigned ShiftOpcode, unsigned Opcode, Type *Ty,
+                              const TargetTransformInfo &TTI) {
+  const auto CostKind = TargetTransformInfo::TCK_Latency;
+  InstructionCost ShiftCost = TTI.getArithmeticInstrCost(
+      ShiftOpcode, Ty, CostKind,
+      {TargetTransformInfo::OK_AnyValue, TargetTransformInfo::OP_None},
+      {TargetTransformInfo::OK_NonUniformConstantValue, TargetTransformInfo::OP_None});
+  InstructionCost OpCost = TTI.getArithmeticInstrCost(
+      Opcode, Ty, CostKind,
+      {TargetTransformInfo::OK_AnyValue, TargetTransformInfo::OP_None},
+      {TargetTransformInfo::OK_NonUniformConstantValue, TargetTransformInfo::OP_None});
+  return ShiftCost.isValid() && OpCost.isValid() && ShiftCost <= OpCost;
+}
+
+// prova a sostituire la moltiplicazione per costante con una sequenza di shift/add/sub.
+// La sostituzione avviene solo se secondo il cost model del target la sequenza non costa
+// più della mul nativa, altrimenti con costanti con molti bit a 1 si peggiorerebbe il codice.
+// Per i vettori la costante può essere uno splat (stessa scomposizione su tutte le lane)
+// oppure avere una potenza di 2 diversa per lane, che diventa uno shift per lane
+Value *reduceMul(BinaryOperator &Instr, const TargetTransformInfo &TTI) {
+  Value *X = Instr.getOperand(0);
+  Value *COp = Instr.getOperand(1);
+  // la moltiplicazione è commutativa: la costante può essere anche il primo operando
+  if (isa<Constant>(X))
+    std::swap(X, COp);
+  auto *CV = dyn_cast<Constant>(COp);
+  if (!CV)
+    return nullptr;
+  Type *Ty = Instr.getType();
+  const APInt *C;
+  if (!match(CV, m_APInt(C))) {
+    Constant *Amounts = getPerLaneLog2(CV, /*Signed=*/false);
+    if (!Amounts || !isPerLaneShiftProfitable(Instruction::Shl, Instruction::Mul, Ty, TTI))
+      return nullptr;
+    return IRBuilder<>(&Instr).CreateShl(X, Amounts);
+  }
+  // x * 0 e x * 1 sono compito di AlgebraicIdentity
+  if (C->isZero() || C->isOne())
+    return nullptr;
+
+  SmallVector<MulTerm, 8> Terms = getNAFTerms(*C);
+  InstructionCost MulCost = TTI.getArithmeticInstrCost(
+      Instruction::Mul, Ty, TargetTransformInfo::TCK_Latency);
+  InstructionCost SeqCost = getTermsCost(Terms, Ty, TTI);
+  if (!SeqCost.isValid() || !MulCost.isValid() || SeqCost > MulCost)
+    return nullptr;
+
+  IRBuilder<> Builder(&Instr);
+  Value *Acc = nullptr;
+  for (const MulTerm &T : Terms) {
+    Value *Term = T.Shift ? Builder.CreateShl(X, T.Shift) : X;
+    if (!Acc)
+      Acc = T.Negative ? Builder.CreateNeg(Term) : Term;
+    else
+      Acc = T.Negative ? Builder.CreateSub(Acc, Term) : Builder.CreateAdd(Acc, Term);
+  }
+  return Acc;
+}
+
+// numero magico per la divisione senza segno per la costante D (Hacker's Delight, magicu):
+// x /u D = (mulhu(x, Magic) >> Shift), oppure, se IsAdd, con il passo di correzione
+// ((x - t) >> 1 + t) >> (Shift - 1) perché Magic non sta in W bit
+struct UnsignedMagic {
+  APInt Magic;
+  unsigned Shift;
+  bool IsAdd;
+};
+
+UnsignedMagic getUnsignedMagic(const APInt &D) {
+  unsigned W = D.getBitWidth();
+  APInt AllOnes = APInt::getAllOnes(W);
+  APInt SignedMin = APInt::getSignedMinValue(W);
+  APInt SignedMax = APInt::getSignedMaxValue(W);
+  bool IsAdd = false;
+  APInt NC = AllOnes - (AllOnes - D).urem(D);
+  unsigned P = W - 1;
+  APInt Q1 = SignedMin.udiv(NC);
+  APInt R1 = SignedMin - Q1 * NC;
+  APInt Q2 = SignedMax.udiv(D);
+  APInt R2 = SignedMax - Q2 * D;
+  APInt Delta;
+  do {
+    ++P;
+    if (R1.uge(NC - R1)) {
+      Q1 = Q1 + Q1 + 1;
+      R1 = R1 + R1 - NC;
+    } else {
+      Q1 = Q1 + Q1;
+      R1 = R1 + R1;
+    }
+    if ((R2 + 1).uge(D - R2)) {
+      if (Q2.uge(SignedMax))
+        IsAdd = true;
+      Q2 = Q2 + Q2 + 1;
+      R2 = R2 + R2 + 1 - D;
+    } else {
+      if (Q2.uge(SignedMin))
+        IsAdd = true;
+      Q2 = Q2 + Q2;
+      R2 = R2 + R2 + 1;
+    }
+    Delta = D - 1 - R2;
+  } while (P < W * 2 && (Q1.ult(Delta) || (Q1 == Delta && R1.isZero())));
+  return {Q2 + 1, P - W, IsAdd};
+}
+
+// numero magico per la divisione con segno per la costante D (Hacker's Delight, magic):
+// x /s D = mulhs(x, Magic) (+/- x se i segni di Magic e D differiscono) >> Shift
+struct SignedMagic {
+  APInt Magic;
+  unsigned Shift;
+};
+
+SignedMagic getSignedMagic(const APInt &D) {
+  unsigned W = D.getBitWidth();
+  APInt SignedMin = APInt::getSignedMinValue(W);
+  APInt AD = D.abs();
+  APInt T = SignedMin + D.lshr(W - 1);
+  APInt ANC = T - 1 - T.urem(AD);
+  unsigned P = W - 1;
+  APInt Q1 = SignedMin.udiv(ANC);
+  APInt R1 = SignedMin - Q1 * ANC;
+  APInt Q2 = SignedMin.udiv(AD);
+  APInt R2 = SignedMin - Q2 * AD;
+  APInt Delta;
+  do {
+    ++P;
+    Q1 <<= 1;
+    R1 <<= 1;
+    if (R1.uge(ANC)) {
+      ++Q1;
+      R1 -= ANC;
+    }
+    Q2 <<= 1;
+    R2 <<= 1;
+    if (R2.uge(AD)) {
+      ++Q2;
+      R2 -= AD;
+    }
+    Delta = AD - R2;
+  } while (Q1.ult(Delta) || (Q1 == Delta && R1.isZero()));
+  APInt Magic = Q2 + 1;
+  if (D.isNegative())
+    Magic.negate();
+  return {Magic, P - W};
+}
+
+// parte alta (W bit superiori) del prodotto a 2W bit fra X e la costante M
+Value *createMulHigh(IRBuilder<> &Builder, Value *X, const APInt &M, bool Signed) {
+  Type *Ty = X->getType();
+  unsigned W = Ty->getScalarSizeInBits();
+  Type *WideTy = Ty->getWithNewBitWidth(2 * W);
+  Value *WideX = Signed ? Builder.CreateSExt(X, WideTy) : Builder.CreateZExt(X, WideTy);
+  Value *WideM = ConstantInt::get(WideTy, Signed ? M.sext(2 * W) : M.zext(2 * W));
+  Value *Prod = Builder.CreateMul(WideX, WideM);
+  return Builder.CreateTrunc(Builder.CreateLShr(Prod, W), Ty);
+}
+
+// x /u D con D costante diversa da 0 e da 1
+Value *createUDiv(IRBuilder<> &Builder, Value *X, const APInt &D) {
+  Type *Ty = X->getType();
+  if (D.isPowerOf2())
+    return Builder.CreateLShr(X, D.logBase2());
+  // se D ha il bit più alto a 1 il quoziente può essere solo 0 o 1
+  if (D.isNegative())
+    return Builder.CreateZExt(Builder.CreateICmpUGE(X, ConstantInt::get(Ty, D)), Ty);
+  UnsignedMagic Mag = getUnsignedMagic(D);
+  Value *Q = createMulHigh(Builder, X, Mag.Magic, /*Signed=*/false);
+  if (!Mag.IsAdd)
+    return Mag.Shift ? Builder.CreateLShr(Q, Mag.Shift) : Q;
+  Value *NPQ = Builder.CreateLShr(Builder.CreateSub(X, Q), 1);
+  return Builder.CreateLShr(Builder.CreateAdd(NPQ, Q), Mag.Shift - 1);
+}
+
+// x /s D con D costante diversa da 0 e da 1. Il quoziente deve essere arrotondato
+// verso zero, quindi per i dividendi negativi serve una correzione (bias)
+Value *createSDiv(IRBuilder<> &Builder, Value *X, const APInt &D) {
+  unsigned W = D.getBitWidth();
+  if (D.isAllOnes())
+    return Builder.CreateNeg(X);
+  // divisore +-2^k: (x + ((x >>s (W-1)) >>u (W-k))) >>s k, cioè si somma 2^k - 1
+  // ai soli dividendi negativi prima dello shift aritmetico
+  APInt AD = D.abs();
+  if (AD.isPowerOf2()) {
+    unsigned K = AD.logBase2();
+    Value *Sign = Builder.CreateAShr(X, W - 1);
+    Value *Bias = Builder.CreateLShr(Sign, W - K);
+    Value *Q = Builder.CreateAShr(Builder.CreateAdd(X, Bias), K);
+    return D.isNegative() ? Builder.CreateNeg(Q) : Q;
+  }
+  SignedMagic Mag = getSignedMagic(D);
+  Value *Q = createMulHigh(Builder, X, Mag.Magic, /*Signed=*/true);
+  if (D.isStrictlyPositive() && Mag.Magic.isNegative())
+    Q = Builder.CreateAdd(Q, X);
+  else if (D.isNegative() && Mag.Magic.isStrictlyPositive())
+    Q = Builder.CreateSub(Q, X);
+  if (Mag.Shift)
+    Q = Builder.CreateAShr(Q, Mag.Shift);
+  // si somma il bit di segno del quoziente per arrotondare verso zero
+  return Builder.CreateAdd(Q, Builder.CreateLShr(Q, W - 1));
+}
+
+// sostituisce sdiv/udiv/srem/urem per costante con moltiplicazioni per il numero magico
+// e shift. Se il dividendo è sicuramente non negativo e il divisore è positivo, la forma
+// con segno viene trattata come quella senza segno, che non ha bisogno di correzioni.
+// Per i vettori il divisore può essere uno splat, oppure avere una potenza di 2 diversa
+// per lane, che diventa uno shift (o una maschera per il resto) per lane
+Value *reduceDivRem(BinaryOperator &Instr, const TargetTransformInfo &TTI,
+                    const DataLayout &DL, AssumptionCache &AC, DominatorTree &DT) {
+  auto *C = dyn_cast<Constant>(Instr.getOperand(1));
+  if (!C)
+    return nullptr;
+  Value *X = Instr.getOperand(0);
+  unsigned Opcode = Instr.getOpcode();
+  bool IsRem = Opcode == Instruction::SRem || Opcode == Instruction::URem;
+  bool Signed = Opcode == Instruction::SDiv || Opcode == Instruction::SRem;
+  auto isNonNegative = [&]() {
+    return computeKnownBits(X, DL, 0, &AC, &Instr, &DT).isNonNegative();
+  };
+
+  IRBuilder<> Builder(&Instr);
+  const APInt *DPtr;
+  if (!match(C, m_APInt(DPtr))) {
+    if (Signed && !isNonNegative())
+      return nullptr;
+    Constant *Amounts = getPerLaneLog2(C, Signed);
+    if (!Amounts)
+      return nullptr;
+    if (IsRem)
+      return Builder.CreateAnd(X, ConstantExpr::getSub(C, ConstantInt::get(C->getType(), 1)));
+    if (!isPerLaneShiftProfitable(Instruction::LShr, Opcode, C->getType(), TTI))
+      return nullptr;
+    return Builder.CreateLShr(X, Amounts);
+  }
+  const APInt &D = *DPtr;
+  // la divisione per 0 è UB, quella per 1 è compito di AlgebraicIdentity
+  if (D.isZero() || D.isOne())
+    return nullptr;
+  if (Signed && D.isStrictlyPositive() && isNonNegative())
+    Signed = false;
+
+  if (IsRem && !Signed && D.isPowerOf2())
+    return Builder.CreateAnd(X, ConstantInt::get(X->getType(), D - 1));
+  Value *Q = Signed ? createSDiv(Builder, X, D) : createUDiv(Builder, X, D);
+  if (!IsRem)
+    return Q;
+  // x % D = x - (x / D) * D, e la moltiplicazione per D viene a sua volta ridotta
+  // con un dividendo costante IRBuilder piega già il prodotto
+  Value *Prod = Builder.CreateMul(Q, C);
+  auto *Mul = dyn_cast<BinaryOperator>(Prod);
+  if (Value *Repl = Mul ? reduceMul(*Mul, TTI) : nullptr) {
+    Mul->replaceAllUsesWith(Repl);
+    Mul->eraseFromParent();
+    Prod = Repl;
+  }
+  return Builder.CreateSub(X, Prod);
+}
+
 // New PM implementation
 struct StrenghtReduction: PassInfoMixin<StrenghtReduction> {
   // Main entry point, takes IR unit to run the pass on (&F) and the
   // corresponding pass manager (to be queried if need be)
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
-    // il booleano changes serve per capire se ci sono stati cambiamenti e in caso positivo abilita nuovamente il while
-    // per controllare se ci sono altre ottimizzazioni da fare
-    bool changes = false;
-    // mentre anyChanges tiene conto di ogni modifica
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    const TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+    AssumptionCache &AC = AM.getResult<AssumptionAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    // anyChanges tiene conto di ogni modifica
     bool anyChanges = false;
-    // scorro tutti i blocchi base della funzione
-    for(auto B = F.begin(), BE = F.end(); B != BE; ++B) {
-      BasicBlock &BB = *B;
-      do{
-        changes = false;
-        //scorro tutte le istruzioni del blocco base
-        for(auto I = BB.begin(), IE = BB.end(); I != IE; ++I) {
-          Instruction &Instr = *I;
-          // se l'istruzione è una moltiplicazione controllo se il secondo operando è una costante e se è una potenza di 2
-          // se è vero allora sostituisco la moltiplicazione con uno shift a sinistra
-          if(Instr.getOpcode() == Instruction::Mul) {
-            auto *Op1 = dyn_cast<ConstantInt>(Instr.getOperand(1));
-            if (Op1 && Op1->getValue().isPowerOf2()) {
-              Instr.replaceAllUsesWith(BinaryOperator::Create(Instruction::Shl, Instr.getOperand(0), ConstantInt::get(Instr.getType(), Op1->getValue().logBase2()), "", &Instr));
-              Instr.eraseFromParent();
-              changes = true;
-              anyChanges = true;
-              break;
-              // se non è una diretta potenza di 2 controllo se il secondo operando è una costante e
-              // se è un numero che si può scrivere come somma di potenze di 2,
-              // se è vero allora sostituisco la moltiplicazione con uno shift a sinistra e una somma
-            } else if (auto *Op1 = dyn_cast<ConstantInt>(Instr.getOperand(1))) {
-              if (Op1) {
-                // utilizzo di valori in 32 bit secondo la scelta di utilizzo nel primo semestre di Compilatori
-                uint32_t Val = Op1->getValue().getZExtValue();
-                // funzione che calcola il logaritmo in base 2 di un numero più piccolo o uguale al numero passato come parametro
-                uint32_t ClosestPowerOf2 = 1UL << Log2_32(Val);
-                // funzione che calcola il logaritmo in base 2 di un numero meno grande o uguale al numero passato come parametro
-                uint32_t ClosestPowerOf2s = 1UL << (Log2_32(Val)+1UL);
-                uint32_t Difference = Val - ClosestPowerOf2;
-                uint32_t Difference2 = Val - ClosestPowerOf2s;
-                //se la differenza è di uno allora posso scrivere il numero come somma di potenze di 2
-                if (Difference - 1 == 0) {
-                  auto *ShiftInstr = BinaryOperator::Create(
-                      Instruction::Shl, Instr.getOperand(0),
-                      ConstantInt::get(Instr.getType(), Log2_32(ClosestPowerOf2)), "", &Instr);
-
-                  auto *AddInstr = BinaryOperator::Create(
-                      Instruction::Add, ShiftInstr,
-                      Instr.getOperand(0), "", &Instr);
-
-                  Instr.replaceAllUsesWith(AddInstr);
-                  Instr.eraseFromParent();
-                  changes = true;
-                  anyChanges = true;
-                  break;
-                  // se la differenza non è di uno controllo se è un numero che si può scrivere come differenza di potenze di 2,
-                  // se è vero allora sostituisco la moltiplicazione con uno shift a sinistra e una sottrazione
-                } else if (Difference2 + 1 == 0){
-                  auto *ShiftInstr = BinaryOperator::Create(
-                      Instruction::Shl, Instr.getOperand(0),
-                      ConstantInt::get(Instr.getType(), Log2_32(ClosestPowerOf2s)), "", &Instr);
-
-                  auto *SubInstr = BinaryOperator::Create(
-                      Instruction::Sub,ShiftInstr ,Instr.getOperand(0) , "", &Instr);
-
-                  Instr.replaceAllUsesWith(SubInstr);
-                  Instr.eraseFromParent();
-                  changes = true;
-                  anyChanges = true;
-                  break;
-                }
-              }
-            }
-            // se non è una moltiplicazione controllo se l'istruzione è una divisione e
-            // se il secondo operando è una costante e se è una potenza di 2,
-            // se è vero allora sostituisco la divisione con uno shift aritmetico a destra
-          } else if (Instr.getOpcode() == Instruction::SDiv){
-            if(auto *Op1 = dyn_cast<ConstantInt>(Instr.getOperand(1))) {
-              if(Op1 && Op1->getValue().isPowerOf2()) {
-                Instr.replaceAllUsesWith(BinaryOperator::Create(Instruction::AShr, Instr.getOperand(0), ConstantInt::get(Instr.getType(), Op1->getValue().logBase2()), "", &Instr));
-                Instr.eraseFromParent();
-                changes = true;
-                anyChanges = true;
-                break;
-              }
-            }
-          } 
+    // scorro tutti i blocchi base della funzione. Le istruzioni generate non sono a loro
+    // volta candidate, quindi basta una sola passata senza ricominciare dall'inizio
+    for (BasicBlock &BB : F) {
+      for (Instruction &Instr : make_early_inc_range(BB)) {
+        // le istruzioni nuove vengono inserite subito prima di Instr, tra Prev e Instr
+        Instruction *Prev = Instr.getPrevNode();
+        Value *Repl = nullptr;
+        // se l'istruzione è una moltiplicazione per costante provo a scomporla in shift e somme
+        if (Instr.getOpcode() == Instruction::Mul) {
+          Repl = reduceMul(cast<BinaryOperator>(Instr), TTI);
+          // se l'istruzione è una divisione o un resto per costante la sostituisco con
+          // moltiplicazione per il numero magico e shift
+        } else if (Instr.getOpcode() == Instruction::SDiv || Instr.getOpcode() == Instruction::UDiv ||
+                   Instr.getOpcode() == Instruction::SRem || Instr.getOpcode() == Instruction::URem) {
+          Repl = reduceDivRem(cast<BinaryOperator>(Instr), TTI, DL, AC, DT);
+        }
+        if (Repl) {
+          // il nome passa solo a un'istruzione appena creata, non a un operando esistente
+          auto *NewInstr = dyn_cast<Instruction>(Repl);
+          if (NewInstr && NewInstr->getParent() == &BB && (!Prev || Prev->comesBefore(NewInstr)))
+            Repl->takeName(&Instr);
+          Instr.replaceAllUsesWith(Repl);
+          Instr.eraseFromParent();
+          anyChanges = true;
         }
-      }while(changes);
+      }
     }
   	if(anyChanges){
       PreservedAnalyses PA;
@@ -0,0 +1,30 @@
+#!/usr/bin/env python3
+# Genera una funzione con un solo blocco base di circa N istruzioni per misurare
+# come AlgebraicIdentity scala con la dimensione del blocco.
+#
+#   python3 gen_identities.py [N] > identities.ll
+#   opt -load-pass-plugin=<path-to>libAlgebraicIdentity.so \
+#     -passes=algebraic-identity -disable-output -time-passes identities.ll
+#
+# Il blocco è una catena di gruppi di 6 istruzioni: due operazioni vere, un'identità
+# diretta (x * 1), una che si semplifica a una costante (x - x) e due che diventano
+# identità solo dopo la sostituzione precedente (y + 0, z | 0). Alla fine restano
+# due istruzioni per gruppo.
+import sys
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 10000
+GROUPS = max(1, N // 6)
+
+out = ["define i32 @block(i32 %a, i32 %b) {", "entry:"]
+prev = "%a"
+for k in range(GROUPS):
+    out.append(f"  %t{k}.0 = add i32 {prev}, %b")
+    out.append(f"  %t{k}.1 = mul i32 %t{k}.0, 1")
+    out.append(f"  %t{k}.2 = sub i32 %t{k}.1, %t{k}.1")
+    out.append(f"  %t{k}.3 = add i32 %t{k}.1, %t{k}.2")
+    out.append(f"  %t{k}.4 = or i32 %t{k}.2, %t{k}.3")
+    out.append(f"  %t{k}.5 = xor i32 %t{k}.4, %a")
+    prev = f"%t{k}.5"
+out.append(f"  ret i32 {prev}")
+out.append("}")
+print("\n".join(out))
@@ -0,0 +1,163 @@
+//=============================================================================
+// FILE:
+//    CodeHoisting.cpp
+//
+// DESCRIPTION:
+//    Code hoisting guidato dalle very busy expressions: se un'espressione è
+//    very busy all'uscita di un blocco con più successori, viene valutata su
+//    tutti i percorsi che partono da lì. La si calcola allora una sola volta
+//    prima del terminatore del blocco e le computazioni identiche nei rami
+//    dominati vengono sostituite dalla copia sollevata.
+//    I blocchi sono visitati in preordine sul dominator tree, quindi ogni
+//    espressione finisce nel primo blocco di diramazione in cui è very busy.
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libCodeHoisting.so -passes="code-hoisting" `\`
+//        -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "VeryBusyExpressions.h"
+
+using namespace llvm;
+using namespace dataflow;
+
+namespace {
+
+class CodeHoister {
+  DominatorTree &DT;
+  VeryBusyExpressionsAnalysis Analysis;
+  DataflowSolver<VeryBusyExpressionsAnalysis> Solver;
+  // per ogni espressione del dominio, le istruzioni che la calcolano
+  SmallVector<SmallVector<Instruction *, 4>, 0> Occurrences;
+
+  // gli operandi devono essere già disponibili prima del terminatore di BB
+  bool areOperandsAvailable(Instruction *E, BasicBlock *BB) {
+    for (Value *Op : E->operands())
+      if (auto *OpI = dyn_cast<Instruction>(Op))
+        if (!DT.dominates(OpI, BB->getTerminator()))
+          return false;
+    return true;
+  }
+
+  bool hoist(unsigned Idx, BasicBlock *BB) {
+    SmallVectorImpl<Instruction *> &Occ = Occurrences[Idx];
+    Instruction *Term = BB->getTerminator();
+    SmallVector<Instruction *, 4> Dominated;
+    for (Instruction *I : Occ) {
+      // già calcolata sopra al terminatore (ad es. sollevata in un dominatore)
+      if (DT.dominates(I, Term))
+        return false;
+      if (I->getParent() != BB && DT.isReachableFromEntry(I->getParent()) &&
+          DT.dominates(BB, I->getParent()))
+        Dominated.push_back(I);
+    }
+    // con una sola occorrenza sarebbe un semplice spostamento, senza guadagno
+    if (Dominated.size() < 2)
+      return false;
+
+    Instruction *Hoisted = Dominated.front()->clone();
+    Hoisted->insertBefore(Term);
+    Hoisted->takeName(Dominated.front());
+    // flag nsw/nuw/exact validi solo se lo sono in tutte le occorrenze
+    for (Instruction *I : Dominated)
+      Hoisted->andIRFlags(I);
+    Hoisted->updateLocationAfterHoist();
+
+    for (Instruction *I : Dominated) {
+      I->replaceAllUsesWith(Hoisted);
+      I->eraseFromParent();
+      Occ.erase(find(Occ, I));
+    }
+    Occ.push_back(Hoisted);
+    return true;
+  }
+
+public:
+  CodeHoister(DominatorTree &DT) : DT(DT), Solver(Analysis) {}
+
+  bool run(Function &F) {
+    Solver.solve(F);
+    Occurrences.resize(Analysis.Exprs.size());
+    for (Instruction &I : instructions(F)) {
+      int Idx = isa<BinaryOperator>(I) ? Analysis.Exprs.lookup(&I) : -1;
+      if (Idx != -1)
+        Occurrences[Idx].push_back(&I);
+    }
+
+    bool Changed = false;
+    for (DomTreeNode *Node : depth_first(DT.getRootNode())) {
+      BasicBlock *BB = Node->getBlock();
+      if (BB->getTerminator()->getNumSuccessors() < 2 || !Solver.isReachable(BB))
+        continue;
+      for (unsigned Idx : Solver.getOut(BB).set_bits()) {
+        if (Occurrences[Idx].empty())
+          continue;
+        // il rappresentante nella tabella può essere già stato cancellato
+        Instruction *E = Occurrences[Idx].front();
+        // very busy non basta per le istruzioni che possono trappare (div per 0):
+        // un percorso potrebbe non arrivare mai alla valutazione
+        if (!isSafeToSpeculativelyExecute(E) || !areOperandsAvailable(E, BB))
+          continue;
+        Changed |= hoist(Idx, BB);
+      }
+    }
+    return Changed;
+  }
+};
+
+// New PM implementation
+struct CodeHoisting: PassInfoMixin<CodeHoisting> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    bool anyChanges = CodeHoister(AM.getResult<DominatorTreeAnalysis>(F)).run(F);
+
+    if (!anyChanges)
+      return PreservedAnalyses::all();
+
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>(); // CFG non modificato
+    PA.preserve<LoopAnalysis>();          // Loops non toccati
+    return PA;
+  }
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "CodeHoisting", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "code-hoisting") {
+                    FPM.addPass(CodeHoisting());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize CodeHoisting when added to the pass pipeline on the
+// command line, i.e. via '-passes=code-hoisting'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
@@ -0,0 +1,175 @@
+//=============================================================================
+// FILE:
+//    ConstantPropagation.cpp
+//
+// DESCRIPTION:
+//    Constant propagation (Assignment2): l'insieme di ogni punto contiene le
+//    coppie (variabile, valore) per cui la variabile vale sicuramente quella
+//    costante. Le variabili sono sia i valori SSA sia le alloca promuovibili
+//    (le variabili locali del codice -O0). Analisi in avanti con meet
+//    intersezione, istanza di DataflowFramework.h: la transfer non è gen/kill
+//    perché il valore di un'istruzione dipende dalle coppie in ingresso, e il
+//    dominio delle coppie cresce durante l'analisi (SparseBitVector).
+//    Stampa IN e OUT di ogni blocco.
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libConstantPropagation.so -passes="constant-propagation" `\`
+//        -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "DataflowFramework.h"
+
+using namespace llvm;
+using namespace dataflow;
+
+namespace {
+
+using VarValue = std::pair<Value *, Constant *>;
+
+struct ConstantPropagationAnalysis
+    : DataflowAnalysis<ConstantPropagationAnalysis, Direction::Forward, MeetOp::Intersection,
+                       SparseBitVector<>> {
+  const DataLayout *DL = nullptr;
+  DomainTable<VarValue> Pairs;
+  // per ogni variabile, le coppie del dominio in cui compare
+  DenseMap<Value *, SmallVector<unsigned, 2>> PairsOf;
+  // alloca trattate come variabili: solo quelle usate esclusivamente da load e store
+  SmallPtrSet<AllocaInst *, 16> Variables;
+
+  void initialize(Function &F) {
+    DL = &F.getParent()->getDataLayout();
+    for (Instruction &I : F.getEntryBlock())
+      if (auto *AI = dyn_cast<AllocaInst>(&I))
+        if (isAllocaPromotable(AI))
+          Variables.insert(AI);
+  }
+
+  // costante associata alla variabile V in S, oppure V stesso se è una costante
+  Constant *getConstant(Value *V, const SparseBitVector<> &S) {
+    if (auto *C = dyn_cast<Constant>(V))
+      return isa<ConstantExpr>(C) ? nullptr : C;
+    auto It = PairsOf.find(V);
+    if (It == PairsOf.end())
+      return nullptr;
+    for (unsigned Idx : It->second)
+      if (S.test(Idx))
+        return Pairs[Idx].second;
+    return nullptr;
+  }
+
+  void define(Value *V, Constant *C, SparseBitVector<> &S) {
+    // la nuova definizione uccide i valori precedenti della variabile
+    for (unsigned Idx : PairsOf.lookup(V))
+      S.reset(Idx);
+    if (!C)
+      return;
+    unsigned NumPairs = Pairs.size();
+    unsigned Idx = Pairs.intern({V, C});
+    if (Idx == NumPairs)
+      PairsOf[V].push_back(Idx);
+    S.set(Idx);
+  }
+
+  // le phi vengono valutate sugli archi: sull'arco P -> BB la phi vale il valore in
+  // ingresso da P, e il meet tiene la coppia solo se tutti gli archi sono d'accordo
+  SparseBitVector<> transferEdge(BasicBlock *From, BasicBlock *To, const SparseBitVector<> &S) {
+    SparseBitVector<> Result = S;
+    for (PHINode &Phi : To->phis())
+      define(&Phi, getConstant(Phi.getIncomingValueForBlock(From), S), Result);
+    return Result;
+  }
+
+  // valore costante dell'istruzione dati i valori costanti in S, o nullptr
+  Constant *evaluate(Instruction &I, const SparseBitVector<> &S) {
+    if (auto *Load = dyn_cast<LoadInst>(&I)) {
+      auto *AI = dyn_cast<AllocaInst>(Load->getPointerOperand());
+      return AI && Variables.count(AI) ? getConstant(AI, S) : nullptr;
+    }
+    if (!isa<BinaryOperator>(I) && !isa<CmpInst>(I) && !isa<CastInst>(I) && !isa<SelectInst>(I))
+      return nullptr;
+    SmallVector<Constant *, 4> Ops;
+    for (Value *Op : I.operands()) {
+      Constant *C = getConstant(Op, S);
+      if (!C)
+        return nullptr;
+      Ops.push_back(C);
+    }
+    Constant *Folded = ConstantFoldInstOperands(&I, Ops, *DL);
+    return Folded && !isa<ConstantExpr>(Folded) ? Folded : nullptr;
+  }
+
+  SparseBitVector<> transfer(BasicBlock &BB, const SparseBitVector<> &In) {
+    SparseBitVector<> Out = In;
+    for (Instruction &I : make_range(BB.getFirstNonPHI()->getIterator(), BB.end())) {
+      if (auto *Store = dyn_cast<StoreInst>(&I)) {
+        auto *AI = dyn_cast<AllocaInst>(Store->getPointerOperand());
+        if (AI && Variables.count(AI))
+          define(AI, getConstant(Store->getValueOperand(), Out), Out);
+        continue;
+      }
+      if (Constant *C = evaluate(I, Out))
+        define(&I, C, Out);
+    }
+    return Out;
+  }
+
+  void printElement(raw_ostream &OS, unsigned I) {
+    OS << "(";
+    Pairs[I].first->printAsOperand(OS, false);
+    OS << ", ";
+    Pairs[I].second->printAsOperand(OS, false);
+    OS << ")";
+  }
+};
+
+// New PM implementation
+struct ConstantPropagation: PassInfoMixin<ConstantPropagation> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+    ConstantPropagationAnalysis Analysis;
+    DataflowSolver<ConstantPropagationAnalysis> Solver(Analysis);
+    Solver.solve(F);
+    errs() << "Constant propagation di " << F.getName() << ":\n";
+    Solver.print(errs());
+    return PreservedAnalyses::all();
+  }
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "ConstantPropagation", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "constant-propagation") {
+                    FPM.addPass(ConstantPropagation());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize ConstantPropagation when added to the pass pipeline on the
+// command line, i.e. via '-passes=constant-propagation'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
@@ -0,0 +1,317 @@
+//=============================================================================
+// FILE:
+//    DataflowFramework.h
+//
+// DESCRIPTION:
+//    Framework generico per analisi dataflow a bit vector. Un'analisi è una
+//    classe che deriva da DataflowAnalysis e specifica:
+//      - la direzione (Forward / Backward),
+//      - l'operatore di meet (Union / Intersection),
+//      - il tipo di insieme (BitVector denso o SparseBitVector),
+//      - le funzioni gen/kill di ogni blocco (oppure una transfer personalizzata).
+//    Gli elementi del dominio (espressioni, blocchi, coppie variabile-valore...)
+//    vengono internati in una DomainTable che assegna a ciascuno un bit.
+//    DataflowSolver risolve l'analisi con una worklist visitata in reverse
+//    post-order (post-order per le analisi all'indietro).
+//
+// License: MIT
+//=============================================================================
+#ifndef ASSIGNMENT2_DATAFLOWFRAMEWORK_H
+#define ASSIGNMENT2_DATAFLOWFRAMEWORK_H
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace dataflow {
+
+using namespace llvm;
+
+enum class Direction { Forward, Backward };
+enum class MeetOp { Union, Intersection };
+
+//-----------------------------------------------------------------------------
+// Operazioni sugli insiemi: stessa interfaccia per BitVector e SparseBitVector
+//-----------------------------------------------------------------------------
+template <typename SetT> struct SetTraits;
+
+template <> struct SetTraits<BitVector> {
+  static void insert(BitVector &S, unsigned I) {
+    if (S.size() <= I)
+      S.resize(I + 1);
+    S.set(I);
+  }
+  static bool contains(const BitVector &S, unsigned I) { return I < S.size() && S.test(I); }
+  // BitVector tratta i bit oltre la dimensione come 0, quindi gli insiemi possono
+  // avere dimensioni diverse se il dominio cresce durante l'analisi
+  static void intersect(BitVector &S, const BitVector &R) { S &= R; }
+  static void unite(BitVector &S, const BitVector &R) { S |= R; }
+  static void subtract(BitVector &S, const BitVector &R) { S.reset(R); }
+  static bool equal(const BitVector &A, const BitVector &B) {
+    if (A.size() == B.size())
+      return A == B;
+    BitVector LHS(A), RHS(B);
+    unsigned N = std::max(A.size(), B.size());
+    LHS.resize(N);
+    RHS.resize(N);
+    return LHS == RHS;
+  }
+  template <typename FnT> static void forEach(const BitVector &S, FnT Fn) {
+    for (unsigned I : S.set_bits())
+      Fn(I);
+  }
+};
+
+template <> struct SetTraits<SparseBitVector<>> {
+  static void insert(SparseBitVector<> &S, unsigned I) { S.set(I); }
+  static bool contains(const SparseBitVector<> &S, unsigned I) { return S.test(I); }
+  static void intersect(SparseBitVector<> &S, const SparseBitVector<> &R) { S &= R; }
+  static void unite(SparseBitVector<> &S, const SparseBitVector<> &R) { S |= R; }
+  static void subtract(SparseBitVector<> &S, const SparseBitVector<> &R) { S.intersectWithComplement(R); }
+  static bool equal(const SparseBitVector<> &A, const SparseBitVector<> &B) { return A == B; }
+  template <typename FnT> static void forEach(const SparseBitVector<> &S, FnT Fn) {
+    for (unsigned I : S)
+      Fn(I);
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Tabella del dominio: assegna un indice (bit) a ogni elemento internato
+//-----------------------------------------------------------------------------
+template <typename ElemT, typename InfoT = DenseMapInfo<ElemT>> class DomainTable {
+  DenseMap<ElemT, unsigned, InfoT> Index;
+  SmallVector<ElemT, 32> Elems;
+
+public:
+  // ritorna l'indice dell'elemento, aggiungendolo al dominio se non c'è ancora
+  unsigned intern(const ElemT &E) {
+    auto It = Index.try_emplace(E, Elems.size());
+    if (It.second)
+      Elems.push_back(E);
+    return It.first->second;
+  }
+  // indice dell'elemento, oppure -1 se non fa parte del dominio
+  int lookup(const ElemT &E) const {
+    auto It = Index.find(E);
+    return It == Index.end() ? -1 : static_cast<int>(It->second);
+  }
+  const ElemT &operator[](unsigned I) const { return Elems[I]; }
+  unsigned size() const { return Elems.size(); }
+};
+
+// espressioni come elementi del dominio: due istruzioni sono la stessa espressione se
+// calcolano la stessa operazione sugli stessi operandi (a meno della commutatività)
+struct ExpressionInfo {
+  static Instruction *getEmptyKey() { return DenseMapInfo<Instruction *>::getEmptyKey(); }
+  static Instruction *getTombstoneKey() { return DenseMapInfo<Instruction *>::getTombstoneKey(); }
+
+  static unsigned getHashValue(const Instruction *I) {
+    Value *LHS = I->getOperand(0);
+    Value *RHS = I->getNumOperands() > 1 ? I->getOperand(1) : nullptr;
+    if (I->isCommutative() && std::less<Value *>()(RHS, LHS))
+      std::swap(LHS, RHS);
+    return hash_combine(I->getOpcode(), I->getType(), LHS, RHS);
+  }
+
+  static bool isEqual(const Instruction *LHS, const Instruction *RHS) {
+    if (LHS == RHS)
+      return true;
+    if (LHS == getEmptyKey() || LHS == getTombstoneKey() ||
+        RHS == getEmptyKey() || RHS == getTombstoneKey())
+      return false;
+    if (LHS->isIdenticalToWhenDefined(RHS))
+      return true;
+    return LHS->isCommutative() && LHS->getOpcode() == RHS->getOpcode() &&
+           LHS->getType() == RHS->getType() &&
+           LHS->getOperand(0) == RHS->getOperand(1) &&
+           LHS->getOperand(1) == RHS->getOperand(0);
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Base delle analisi
+//-----------------------------------------------------------------------------
+// Derived deve definire:
+//   void computeGenKill(BasicBlock &BB, SetT &Gen, SetT &Kill);
+// e può ridefinire:
+//   void initialize(Function &F);           // costruzione del dominio
+//   SetT getBoundary();                     // valore all'entry (avanti) o alle uscite (indietro)
+//   SetT transfer(BasicBlock &BB, const SetT &Input);  // transfer non gen/kill
+//   SetT transferEdge(BasicBlock *From, BasicBlock *To, const SetT &S);  // transfer sull'arco From->To
+//   void printElement(raw_ostream &OS, unsigned I);
+template <typename Derived, Direction Dir, MeetOp Meet, typename SetT = BitVector>
+class DataflowAnalysis {
+  DenseMap<const BasicBlock *, std::pair<SetT, SetT>> GenKill;
+
+public:
+  using Set = SetT;
+  static constexpr Direction Dirn = Dir;
+  static constexpr MeetOp MeetKind = Meet;
+
+  void initialize(Function &) {}
+  SetT getBoundary() { return SetT(); }
+
+  // transfer classica: out = gen U (in - kill) in avanti, in = gen U (out - kill) all'indietro.
+  // Gen e kill di ogni blocco vengono calcolati una sola volta
+  SetT transfer(BasicBlock &BB, const SetT &Input) {
+    auto It = GenKill.find(&BB);
+    if (It == GenKill.end()) {
+      std::pair<SetT, SetT> GK;
+      static_cast<Derived *>(this)->computeGenKill(BB, GK.first, GK.second);
+      It = GenKill.try_emplace(&BB, std::move(GK)).first;
+    }
+    SetT Result = Input;
+    SetTraits<SetT>::subtract(Result, It->second.second);
+    SetTraits<SetT>::unite(Result, It->second.first);
+    return Result;
+  }
+
+  // transfer sull'arco From -> To del CFG, applicata all'insieme che attraversa l'arco
+  // prima del meet (utile per le phi e per gli archi non eseguibili)
+  SetT transferEdge(BasicBlock *, BasicBlock *, const SetT &S) { return S; }
+
+  void printElement(raw_ostream &OS, unsigned I) { OS << I; }
+};
+
+//-----------------------------------------------------------------------------
+// Solver
+//-----------------------------------------------------------------------------
+template <typename AnalysisT> class DataflowSolver {
+  using SetT = typename AnalysisT::Set;
+  using Traits = SetTraits<SetT>;
+  static constexpr bool IsForward = AnalysisT::Dirn == Direction::Forward;
+
+  AnalysisT &Analysis;
+  // blocchi nell'ordine di visita e loro posizione in quell'ordine
+  std::vector<BasicBlock *> Order;
+  DenseMap<const BasicBlock *, unsigned> Position;
+  std::vector<SetT> In, Out;
+
+  // insieme in ingresso alla transfer (In in avanti, Out all'indietro) e in uscita
+  SetT &input(unsigned I) { return IsForward ? In[I] : Out[I]; }
+  SetT &output(unsigned I) { return IsForward ? Out[I] : In[I]; }
+
+public:
+  DataflowSolver(AnalysisT &Analysis) : Analysis(Analysis) {}
+
+  void solve(Function &F) {
+    Analysis.initialize(F);
+    // reverse post-order per le analisi in avanti: ogni blocco viene visitato dopo i suoi
+    // predecessori (a parte i back edge). Per quelle all'indietro si usa il post-order
+    ReversePostOrderTraversal<Function *> RPOT(&F);
+    Order.assign(RPOT.begin(), RPOT.end());
+    if (!IsForward)
+      std::reverse(Order.begin(), Order.end());
+    unsigned N = Order.size();
+    for (unsigned I = 0; I < N; ++I)
+      Position[Order[I]] = I;
+    In.assign(N, SetT());
+    Out.assign(N, SetT());
+
+    // un blocco non ancora visitato vale come top del meet (l'insieme universo per
+    // l'intersezione, vuoto per l'unione) e viene ignorato nel meet: così non serve
+    // costruire l'insieme universo e il dominio può crescere durante l'analisi
+    BitVector Visited(N);
+    BitVector Pending(N, true);
+    while (Pending.any()) {
+      for (int I = Pending.find_first(); I != -1; I = Pending.find_next(I)) {
+        Pending.reset(I);
+        BasicBlock *BB = Order[I];
+        SetT Input = meet(BB, Visited);
+        SetT Output = Analysis.transfer(*BB, Input);
+        input(I) = std::move(Input);
+        if (Visited.test(I) && Traits::equal(Output, output(I)))
+          continue;
+        output(I) = std::move(Output);
+        Visited.set(I);
+        for (BasicBlock *Next : flowSuccessors(BB)) {
+          auto It = Position.find(Next);
+          if (It != Position.end())
+            Pending.set(It->second);
+        }
+      }
+    }
+  }
+
+  // valore all'ingresso del blocco nell'ordine del programma (non della direzione)
+  const SetT &getIn(const BasicBlock *BB) const { return In[Position.lookup(BB)]; }
+  const SetT &getOut(const BasicBlock *BB) const { return Out[Position.lookup(BB)]; }
+  bool isReachable(const BasicBlock *BB) const { return Position.count(BB); }
+
+  void print(raw_ostream &OS) {
+    auto PrintSet = [&](const SetT &S) {
+      OS << "{";
+      bool First = true;
+      Traits::forEach(S, [&](unsigned E) {
+        OS << (First ? " " : ", ");
+        Analysis.printElement(OS, E);
+        First = false;
+      });
+      OS << " }\n";
+    };
+    for (BasicBlock *BB : IsForward ? Order : std::vector<BasicBlock *>(Order.rbegin(), Order.rend())) {
+      BB->printAsOperand(OS, false);
+      OS << ":\n  IN  = ";
+      PrintSet(getIn(BB));
+      OS << "  OUT = ";
+      PrintSet(getOut(BB));
+    }
+  }
+
+private:
+  // blocchi da cui arriva l'informazione (predecessori in avanti, successori all'indietro)
+  // e blocchi a cui va propagata
+  static auto flowPredecessors(BasicBlock *BB) {
+    if constexpr (IsForward)
+      return predecessors(BB);
+    else
+      return successors(BB);
+  }
+  static auto flowSuccessors(BasicBlock *BB) {
+    if constexpr (IsForward)
+      return successors(BB);
+    else
+      return predecessors(BB);
+  }
+
+  SetT meet(BasicBlock *BB, const BitVector &Visited) {
+    SetT Result;
+    bool Any = false;
+    for (BasicBlock *P : flowPredecessors(BB)) {
+      auto It = Position.find(P);
+      if (It == Position.end() || !Visited.test(It->second))
+        continue;
+      SetT S = IsForward ? Analysis.transferEdge(P, BB, output(It->second))
+                         : Analysis.transferEdge(BB, P, output(It->second));
+      if (!Any)
+        Result = std::move(S);
+      else if (AnalysisT::MeetKind == MeetOp::Intersection)
+        Traits::intersect(Result, S);
+      else
+        Traits::unite(Result, S);
+      Any = true;
+    }
+    // l'entry (avanti) e i blocchi senza successori (indietro) prendono il valore di bordo
+    if (IsForward ? BB->isEntryBlock() : succ_empty(BB)) {
+      SetT Boundary = Analysis.getBoundary();
+      if (!Any)
+        return Boundary;
+      if (AnalysisT::MeetKind == MeetOp::Intersection)
+        Traits::intersect(Result, Boundary);
+      else
+        Traits::unite(Result, Boundary);
+    }
+    return Result;
+  }
+};
+
+} // namespace dataflow
+
+#endif // ASSIGNMENT2_DATAFLOWFRAMEWORK_H
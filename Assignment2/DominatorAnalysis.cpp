@@ -0,0 +1,91 @@
+//=============================================================================
+// FILE:
+//    DominatorAnalysis.cpp
+//
+// DESCRIPTION:
+//    Analisi dei dominatori (Assignment2): un blocco A domina B se A si trova su
+//    tutti i percorsi dall'entry a B. Analisi in avanti con meet intersezione,
+//    istanza di DataflowFramework.h in cui ogni blocco genera se stesso.
+//    Stampa IN e OUT di ogni blocco (OUT = insieme dei dominatori del blocco).
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libDominatorAnalysis.so -passes="dominator-analysis" `\`
+//        -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "DataflowFramework.h"
+
+using namespace llvm;
+using namespace dataflow;
+
+namespace {
+
+// dominio: i blocchi base della funzione
+struct DominatorsAnalysis
+    : DataflowAnalysis<DominatorsAnalysis, Direction::Forward, MeetOp::Intersection> {
+  DomainTable<BasicBlock *> Blocks;
+
+  void initialize(Function &F) {
+    for (BasicBlock &BB : F)
+      Blocks.intern(&BB);
+  }
+
+  // gen: il blocco stesso, kill: nulla
+  void computeGenKill(BasicBlock &BB, BitVector &Gen, BitVector &Kill) {
+    Gen.resize(Blocks.size());
+    Kill.resize(Blocks.size());
+    Gen.set(Blocks.lookup(&BB));
+  }
+
+  void printElement(raw_ostream &OS, unsigned I) { Blocks[I]->printAsOperand(OS, false); }
+};
+
+// New PM implementation
+struct DominatorAnalysis: PassInfoMixin<DominatorAnalysis> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+    DominatorsAnalysis Analysis;
+    DataflowSolver<DominatorsAnalysis> Solver(Analysis);
+    Solver.solve(F);
+    errs() << "Dominatori di " << F.getName() << ":\n";
+    Solver.print(errs());
+    return PreservedAnalyses::all();
+  }
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "DominatorAnalysis", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "dominator-analysis") {
+                    FPM.addPass(DominatorAnalysis());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize DominatorAnalysis when added to the pass pipeline on the
+// command line, i.e. via '-passes=dominator-analysis'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
@@ -0,0 +1,374 @@
+//=============================================================================
+// FILE:
+//    SparseConditionalConstantPropagation.cpp
+//
+// DESCRIPTION:
+//    Sparse conditional constant propagation (Wegman-Zadeck). A differenza di
+//    ConstantPropagation.cpp, che lavora su coppie (variabile, valore) per
+//    blocco, qui il lattice (Unknown -> costante -> Overdefined) è associato a
+//    ogni valore SSA e propagato lungo le catene def-use. Gli archi del CFG
+//    diventano eseguibili solo quando la condizione del salto lo permette,
+//    quindi i rami mai presi non contaminano le phi.
+//    Alla fine:
+//      - i valori costanti sostituiscono le istruzioni,
+//      - i salti con un solo successore eseguibile diventano incondizionati,
+//      - i blocchi non eseguibili vengono cancellati,
+//    aggiornando il dominator tree in modo incrementale (DomTreeUpdater).
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libSparseConditionalConstantPropagation.so `\`
+//        -passes="sccp-pass" -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+namespace {
+
+// Unknown (top): nessuna definizione eseguibile vista finora
+// ConstantValue: sempre uguale a C
+// Overdefined (bottom): non costante
+struct LatticeValue {
+  enum StateT { Unknown, ConstantValue, Overdefined } State = Unknown;
+  Constant *C = nullptr;
+
+  static LatticeValue get(Constant *C) { return {ConstantValue, C}; }
+  static LatticeValue getOverdefined() { return {Overdefined, nullptr}; }
+
+  bool isUnknown() const { return State == Unknown; }
+  bool isConstant() const { return State == ConstantValue; }
+  bool isOverdefined() const { return State == Overdefined; }
+
+  // meet con Other, true se il valore è cambiato
+  bool mergeIn(const LatticeValue &Other) {
+    if (isOverdefined() || Other.isUnknown())
+      return false;
+    if (isUnknown()) {
+      *this = Other;
+      return true;
+    }
+    if (Other.isConstant() && Other.C == C)
+      return false;
+    *this = getOverdefined();
+    return true;
+  }
+};
+
+class SCCPSolver {
+  const DataLayout &DL;
+  const TargetLibraryInfo &TLI;
+  DenseMap<Value *, LatticeValue> Values;
+  SmallPtrSet<BasicBlock *, 32> Executable;
+  DenseSet<std::pair<BasicBlock *, BasicBlock *>> ExecutableEdges;
+  SmallVector<BasicBlock *, 32> BlockWorklist;
+  // istruzioni il cui valore è cambiato: i loro user vanno rivisitati
+  SmallVector<Instruction *, 64> InstWorklist;
+
+  LatticeValue getValueState(Value *V) {
+    if (auto *C = dyn_cast<Constant>(V))
+      return LatticeValue::get(C);
+    if (isa<Instruction>(V))
+      return Values.lookup(V);
+    // argomenti e altri valori esterni
+    return LatticeValue::getOverdefined();
+  }
+
+  void mergeInValue(Instruction &I, const LatticeValue &LV) {
+    if (Values[&I].mergeIn(LV))
+      InstWorklist.push_back(&I);
+  }
+
+  void markOverdefined(Instruction &I) { mergeInValue(I, LatticeValue::getOverdefined()); }
+
+  void markEdgeExecutable(BasicBlock *From, BasicBlock *To) {
+    if (!ExecutableEdges.insert({From, To}).second)
+      return;
+    if (Executable.insert(To).second) {
+      BlockWorklist.push_back(To);
+      return;
+    }
+    // blocco già visitato: cambia solo il valore delle phi
+    for (PHINode &Phi : To->phis())
+      visitPHI(Phi);
+  }
+
+  void visitPHI(PHINode &Phi) {
+    for (unsigned I = 0, E = Phi.getNumIncomingValues(); I != E; ++I)
+      if (ExecutableEdges.count({Phi.getIncomingBlock(I), Phi.getParent()}))
+        mergeInValue(Phi, getValueState(Phi.getIncomingValue(I)));
+  }
+
+  void visitTerminator(Instruction &Term) {
+    // invoke e callbr producono anche un valore, di cui non si sa nulla
+    if (!Term.getType()->isVoidTy())
+      markOverdefined(Term);
+    BasicBlock *BB = Term.getParent();
+    Value *Cond = nullptr;
+    if (auto *Br = dyn_cast<BranchInst>(&Term))
+      Cond = Br->isConditional() ? Br->getCondition() : nullptr;
+    else if (auto *Switch = dyn_cast<SwitchInst>(&Term))
+      Cond = Switch->getCondition();
+
+    LatticeValue CondLV = Cond ? getValueState(Cond) : LatticeValue::getOverdefined();
+    if (CondLV.isUnknown())
+      return;
+    auto *CI = CondLV.isConstant() ? dyn_cast<ConstantInt>(CondLV.C) : nullptr;
+    if (!CI) {
+      // condizione non costante (o undef/espressione): tutti i successori
+      for (BasicBlock *Succ : successors(BB))
+        markEdgeExecutable(BB, Succ);
+      return;
+    }
+    if (auto *Br = dyn_cast<BranchInst>(&Term))
+      markEdgeExecutable(BB, Br->getSuccessor(CI->isZero() ? 1 : 0));
+    else
+      markEdgeExecutable(BB, cast<SwitchInst>(Term).findCaseValue(CI)->getCaseSuccessor());
+  }
+
+  void visitSelect(SelectInst &Sel) {
+    LatticeValue CondLV = getValueState(Sel.getCondition());
+    if (CondLV.isUnknown())
+      return;
+    auto *CI = CondLV.isConstant() ? dyn_cast<ConstantInt>(CondLV.C) : nullptr;
+    if (CI) {
+      mergeInValue(Sel, getValueState(CI->isZero() ? Sel.getFalseValue() : Sel.getTrueValue()));
+      return;
+    }
+    mergeInValue(Sel, getValueState(Sel.getTrueValue()));
+    mergeInValue(Sel, getValueState(Sel.getFalseValue()));
+  }
+
+  // operazioni pure: costante se tutti gli operandi lo sono
+  void visitFoldable(Instruction &I) {
+    SmallVector<Constant *, 4> Ops;
+    for (Value *Op : I.operands()) {
+      LatticeValue LV = getValueState(Op);
+      if (LV.isOverdefined())
+        return markOverdefined(I);
+      if (LV.isUnknown())
+        return;
+      Ops.push_back(LV.C);
+    }
+    Constant *C = nullptr;
+    if (auto *Cmp = dyn_cast<CmpInst>(&I))
+      C = ConstantFoldCompareInstOperands(Cmp->getPredicate(), Ops[0], Ops[1], DL, &TLI);
+    else
+      C = ConstantFoldInstOperands(&I, Ops, DL, &TLI);
+    if (!C)
+      return markOverdefined(I);
+    mergeInValue(I, LatticeValue::get(C));
+  }
+
+  void visit(Instruction &I) {
+    if (auto *Phi = dyn_cast<PHINode>(&I))
+      visitPHI(*Phi);
+    else if (I.isTerminator())
+      visitTerminator(I);
+    else if (auto *Sel = dyn_cast<SelectInst>(&I))
+      visitSelect(*Sel);
+    else if (isa<BinaryOperator>(I) || isa<UnaryOperator>(I) || isa<CmpInst>(I) ||
+             isa<CastInst>(I) || isa<GetElementPtrInst>(I))
+      visitFoldable(I);
+    else if (!I.getType()->isVoidTy())
+      // load, call, ...: nessuna informazione
+      markOverdefined(I);
+  }
+
+  void solve() {
+    while (!BlockWorklist.empty() || !InstWorklist.empty()) {
+      while (!InstWorklist.empty()) {
+        Instruction *I = InstWorklist.pop_back_val();
+        for (User *U : I->users()) {
+          auto *UI = cast<Instruction>(U);
+          if (Executable.count(UI->getParent()))
+            visit(*UI);
+        }
+      }
+      while (!BlockWorklist.empty()) {
+        BasicBlock *BB = BlockWorklist.pop_back_val();
+        for (Instruction &I : *BB)
+          visit(I);
+      }
+    }
+  }
+
+  // un salto su un valore rimasto Unknown (ad es. dipendente da un ciclo mai
+  // risolto) non ha successori eseguibili: li si considera tutti raggiungibili
+  bool resolveUnknownBranches(Function &F) {
+    bool Changed = false;
+    for (BasicBlock &BB : F) {
+      if (!Executable.count(&BB) || succ_empty(&BB))
+        continue;
+      if (any_of(successors(&BB), [&](BasicBlock *S) { return ExecutableEdges.count({&BB, S}); }))
+        continue;
+      for (BasicBlock *Succ : successors(&BB))
+        markEdgeExecutable(&BB, Succ);
+      Changed = true;
+    }
+    return Changed;
+  }
+
+public:
+  SCCPSolver(const DataLayout &DL, const TargetLibraryInfo &TLI) : DL(DL), TLI(TLI) {}
+
+  void run(Function &F) {
+    BasicBlock *Entry = &F.getEntryBlock();
+    Executable.insert(Entry);
+    BlockWorklist.push_back(Entry);
+    do
+      solve();
+    while (resolveUnknownBranches(F));
+  }
+
+  bool isExecutable(BasicBlock *BB) const { return Executable.count(BB); }
+  bool isEdgeExecutable(BasicBlock *From, BasicBlock *To) const {
+    return ExecutableEdges.count({From, To});
+  }
+  Constant *getConstant(Instruction &I) const {
+    LatticeValue LV = Values.lookup(&I);
+    return LV.isConstant() ? LV.C : nullptr;
+  }
+};
+
+// sostituisce le istruzioni costanti con il loro valore
+bool replaceConstants(Function &F, SCCPSolver &Solver) {
+  bool Changed = false;
+  for (BasicBlock &BB : F) {
+    if (!Solver.isExecutable(&BB))
+      continue;
+    for (Instruction &I : make_early_inc_range(BB)) {
+      Constant *C = I.getType()->isVoidTy() ? nullptr : Solver.getConstant(I);
+      if (!C)
+        continue;
+      I.replaceAllUsesWith(C);
+      if (isInstructionTriviallyDead(&I))
+        I.eraseFromParent();
+      Changed = true;
+    }
+  }
+  return Changed;
+}
+
+// i salti con un solo successore eseguibile diventano incondizionati
+bool foldBranches(Function &F, SCCPSolver &Solver, DomTreeUpdater &DTU) {
+  bool Changed = false;
+  SmallVector<DominatorTree::UpdateType, 8> Updates;
+  for (BasicBlock &BB : F) {
+    Instruction *Term = BB.getTerminator();
+    if (!Solver.isExecutable(&BB) || !(isa<BranchInst>(Term) || isa<SwitchInst>(Term)) ||
+        Term->getNumSuccessors() < 2)
+      continue;
+    BasicBlock *Target = nullptr;
+    bool Unique = true;
+    for (BasicBlock *Succ : successors(&BB)) {
+      if (!Solver.isEdgeExecutable(&BB, Succ))
+        continue;
+      Unique &= !Target || Target == Succ;
+      Target = Succ;
+    }
+    if (!Target || !Unique)
+      continue;
+
+    // rimuove dalle phi dei successori un ingresso per ogni arco eliminato
+    SmallPtrSet<BasicBlock *, 4> Removed;
+    bool KeptTarget = false;
+    for (BasicBlock *Succ : successors(&BB)) {
+      if (Succ == Target && !KeptTarget) {
+        KeptTarget = true;
+        continue;
+      }
+      Succ->removePredecessor(&BB);
+      if (Succ != Target && Removed.insert(Succ).second)
+        Updates.push_back({DominatorTree::Delete, &BB, Succ});
+    }
+    BranchInst::Create(Target, Term);
+    Value *Cond = isa<BranchInst>(Term) ? cast<BranchInst>(Term)->getCondition()
+                                        : cast<SwitchInst>(Term)->getCondition();
+    Term->eraseFromParent();
+    RecursivelyDeleteTriviallyDeadInstructions(Cond);
+    Changed = true;
+  }
+  DTU.applyUpdates(Updates);
+  return Changed;
+}
+
+// New PM implementation
+struct SparseConditionalConstantPropagation
+    : PassInfoMixin<SparseConditionalConstantPropagation> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    SCCPSolver Solver(F.getParent()->getDataLayout(), AM.getResult<TargetLibraryAnalysis>(F));
+    Solver.run(F);
+
+    bool anyChanges = replaceConstants(F, Solver);
+
+    DomTreeUpdater DTU(AM.getResult<DominatorTreeAnalysis>(F),
+                       DomTreeUpdater::UpdateStrategy::Lazy);
+    bool cfgChanges = foldBranches(F, Solver, DTU);
+    SmallVector<BasicBlock *, 8> DeadBlocks;
+    for (BasicBlock &BB : F)
+      if (!Solver.isExecutable(&BB))
+        DeadBlocks.push_back(&BB);
+    if (!DeadBlocks.empty()) {
+      DeleteDeadBlocks(DeadBlocks, &DTU);
+      cfgChanges = true;
+    }
+    DTU.flush();
+
+    if (!anyChanges && !cfgChanges)
+      return PreservedAnalyses::all();
+
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>(); // aggiornato da DomTreeUpdater
+    if (!cfgChanges)
+      PA.preserve<LoopAnalysis>();        // Loops non toccati
+    return PA;
+  }
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "SparseConditionalConstantPropagation", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "sccp-pass") {
+                    FPM.addPass(SparseConditionalConstantPropagation());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize SparseConditionalConstantPropagation when added to the
+// pass pipeline on the command line, i.e. via '-passes=sccp-pass'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
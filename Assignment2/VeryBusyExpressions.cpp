@@ -0,0 +1,72 @@
+//=============================================================================
+// FILE:
+//    VeryBusyExpressions.cpp
+//
+// DESCRIPTION:
+//    Analisi delle very busy expressions (Assignment2): un'espressione è very
+//    busy all'uscita di un blocco se viene valutata su tutti i percorsi che
+//    partono da lì prima che uno dei suoi operandi venga ridefinito.
+//    Analisi all'indietro con meet intersezione, istanza di DataflowFramework.h.
+//    Stampa IN e OUT di ogni blocco.
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libVeryBusyExpressions.so -passes="very-busy" `\`
+//        -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+#include "VeryBusyExpressions.h"
+
+using namespace llvm;
+using namespace dataflow;
+
+namespace {
+
+// New PM implementation
+struct VeryBusyExpressions: PassInfoMixin<VeryBusyExpressions> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+    VeryBusyExpressionsAnalysis Analysis;
+    DataflowSolver<VeryBusyExpressionsAnalysis> Solver(Analysis);
+    Solver.solve(F);
+    errs() << "Very busy expressions di " << F.getName() << ":\n";
+    Solver.print(errs());
+    return PreservedAnalyses::all();
+  }
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "VeryBusyExpressions", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "very-busy") {
+                    FPM.addPass(VeryBusyExpressions());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize VeryBusyExpressions when added to the pass pipeline on the
+// command line, i.e. via '-passes=very-busy'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
@@ -0,0 +1,66 @@
+//=============================================================================
+// FILE:
+//    VeryBusyExpressions.h
+//
+// DESCRIPTION:
+//    Analisi delle very busy expressions come istanza di DataflowFramework.h,
+//    condivisa tra il pass che stampa i risultati (VeryBusyExpressions.cpp) e
+//    il code hoisting (CodeHoisting.cpp).
+//
+// License: MIT
+//=============================================================================
+#ifndef ASSIGNMENT2_VERYBUSYEXPRESSIONS_H
+#define ASSIGNMENT2_VERYBUSYEXPRESSIONS_H
+
+#include "DataflowFramework.h"
+#include "llvm/IR/InstIterator.h"
+
+namespace dataflow {
+
+// dominio: le espressioni binarie della funzione (a+b, b-a, ... come nel foglio)
+struct VeryBusyExpressionsAnalysis
+    : DataflowAnalysis<VeryBusyExpressionsAnalysis, Direction::Backward, MeetOp::Intersection> {
+  DomainTable<Instruction *, ExpressionInfo> Exprs;
+  // per ogni valore, le espressioni che lo usano come operando (uccise dalla sua definizione)
+  DenseMap<Value *, SmallVector<unsigned, 4>> ExprsUsing;
+
+  void initialize(Function &F) {
+    for (Instruction &I : instructions(F)) {
+      if (!isa<BinaryOperator>(I) || Exprs.lookup(&I) != -1)
+        continue;
+      unsigned Idx = Exprs.intern(&I);
+      for (Value *Op : I.operands())
+        if (!isa<Constant>(Op))
+          ExprsUsing[Op].push_back(Idx);
+    }
+  }
+
+  // gen: espressioni valutate nel blocco con operandi definiti fuori dal blocco
+  // kill: espressioni che usano un valore definito nel blocco
+  void computeGenKill(BasicBlock &BB, BitVector &Gen, BitVector &Kill) {
+    Gen.resize(Exprs.size());
+    Kill.resize(Exprs.size());
+    for (Instruction &I : BB) {
+      auto It = ExprsUsing.find(&I);
+      if (It != ExprsUsing.end())
+        for (unsigned Idx : It->second)
+          Kill.set(Idx);
+    }
+    for (Instruction &I : BB) {
+      int Idx = isa<BinaryOperator>(I) ? Exprs.lookup(&I) : -1;
+      if (Idx != -1 && !Kill.test(Idx))
+        Gen.set(Idx);
+    }
+  }
+
+  void printElement(raw_ostream &OS, unsigned I) {
+    Instruction *E = Exprs[I];
+    E->getOperand(0)->printAsOperand(OS, false);
+    OS << " " << E->getOpcodeName() << " ";
+    E->getOperand(1)->printAsOperand(OS, false);
+  }
+};
+
+} // namespace dataflow
+
+#endif // ASSIGNMENT2_VERYBUSYEXPRESSIONS_H
@@ -21,9 +21,27 @@
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopIterator.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
+#include "llvm/Analysis/MustExecute.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 
 using namespace llvm;
+
+#define DEBUG_TYPE "loop-inv"
 //-----------------------------------------------------------------------------
 // TestPass implementation
 //-----------------------------------------------------------------------------
@@ -31,18 +49,36 @@ using namespace llvm;
 // everything in an anonymous namespace.
 
 namespace {
-bool isASafeInstruction(Value *I);
+// copertura del pass (visibile con opt -stats)
+TrackingStatistic NumLoopsExamined(DEBUG_TYPE, "NumLoopsExamined", "Loop esaminati");
+TrackingStatistic NumLoopsSimplified(DEBUG_TYPE, "NumLoopsSimplified", "Loop portati in forma loop-simplify");
+TrackingStatistic NumLoopsNoPreheader(DEBUG_TYPE, "NumLoopsNoPreheader", "Loop senza preheader, non trasformabili");
+TrackingStatistic NumLoopsTransformed(DEBUG_TYPE, "NumLoopsTransformed", "Loop con almeno un'istruzione spostata o promossa");
+TrackingStatistic NumHoisted(DEBUG_TYPE, "NumHoisted", "Istruzioni spostate nel preheader");
+TrackingStatistic NumPromoted(DEBUG_TYPE, "NumPromoted", "Locazioni promosse a registro");
+TrackingStatistic NumSunkToExits(DEBUG_TYPE, "NumSunkToExits", "Istruzioni spostate nei blocchi di uscita");
+TrackingStatistic NumSunkToRareBlocks(DEBUG_TYPE, "NumSunkToRareBlocks", "Istruzioni spostate in rami poco frequenti");
+
+bool isClobberedInLoop(Instruction *I, Loop *L, MemorySSA &MSSA);
+bool isASafeInstruction(Instruction *I, Loop *L, MemorySSA &MSSA);
 bool dominatesAllUses(Instruction *I, DominatorTree &DT, Loop *L);
 bool isDeadAfterLoop(Instruction *I, Loop *L);
-bool isOperLoopInvariant(Instruction &I, Loop *L, DominatorTree &DT, 
-  std::set<Instruction*> &LoopInvariantInst, 
-  std::set<Instruction*> &isChecked);
-bool IsLoopInvariant(Instruction &I, Loop *L, DominatorTree &DT,
-  std::set<Instruction*> &LoopInvariantInst, 
-  std::set<Instruction*> &isChecked);
+bool isOperLoopInvariant(Value &V, Loop *L,
+  const SmallPtrSetImpl<Instruction*> &LoopInvariantInst);
+bool IsLoopInvariant(Instruction &I, Loop *L, MemorySSA &MSSA,
+  const SmallPtrSetImpl<Instruction*> &LoopInvariantInst);
 
+// controlla tramite MemorySSA se una scrittura dentro al loop può modificare la
+// memoria letta dall'istruzione
+bool isClobberedInLoop(Instruction *I, Loop *L, MemorySSA &MSSA) {
+  MemoryUseOrDef *Access = MSSA.getMemoryAccess(I);
+  if (!Access)
+    return false;
+  MemoryAccess *Clobber = MSSA.getWalker()->getClobberingMemoryAccess(Access);
+  return !MSSA.isLiveOnEntryDef(Clobber) && L->contains(Clobber->getBlock());
+}
 // funzione atta a controllare se un valore è considerabile loop invariant
-bool isASafeInstruction(Value *I) {
+bool isASafeInstruction(Instruction *I, Loop *L, MemorySSA &MSSA) {
   if (isa<BinaryOperator>(I)    || 
       isa<CastInst>(I)          || 
       isa<SelectInst>(I)        || 
@@ -50,6 +86,17 @@ bool isASafeInstruction(Value *I) {
       isa<CmpInst>(I)){
     return true;
   }
+  // load non volatili che nessuna scrittura del loop può raggiungere
+  if (LoadInst *Load = dyn_cast<LoadInst>(I)) {
+    return Load->isUnordered() && !isClobberedInLoop(I, L, MSSA);
+  }
+  // call readnone/readonly senza effetti collaterali, con la stessa condizione delle load
+  if (CallInst *Call = dyn_cast<CallInst>(I)) {
+    return !isa<DbgInfoIntrinsic>(Call) && !Call->getType()->isVoidTy() &&
+           Call->onlyReadsMemory() && !Call->mayThrow() && Call->willReturn() &&
+           !Call->isConvergent() && !Call->hasOperandBundles() &&
+           !isClobberedInLoop(I, L, MSSA);
+  }
   return false;
 }
 // data un'istruzione, il dominator tree e il loop, controlla se l'istruzione
@@ -96,54 +143,325 @@ bool isDeadAfterLoop(Instruction *I, Loop *L) {
   }
   return true;
 }
-// controlla un operando dell'istruzione e dice se è loop invariant o no
-bool isOperLoopInvariant(Value &V, Loop *L, DominatorTree &DT,
-  std::set<Instruction*> &LoopInvariantInst,
-  std::set<Instruction*> &isChecked) {
+// controlla un operando dell'istruzione e dice se è loop invariant o no.
+// Le istruzioni del loop vengono visitate in reverse post-order, quindi la
+// definizione di un operando è già stata classificata: basta guardare l'insieme
+bool isOperLoopInvariant(Value &V, Loop *L,
+  const SmallPtrSetImpl<Instruction*> &LoopInvariantInst) {
   // Se l'operando è una costante o un argomento, è loop invariant
   if (isa<Constant>(&V) || isa<Argument>(&V)) {
     return true;
   }
   // se non è un'istruzione allora non viene considerato
   if (Instruction *Inst = dyn_cast<Instruction>(&V)) {
-    // Se non è dentro il loop, è considerato loop invariant
-    if (!L->contains(Inst)) {
-      return true;
-    }
-    // Se già marcato come invariant, ritorna true
-    if (LoopInvariantInst.count(Inst)) {
-      return true;
-    }
-    // Se già controllata ma non invariant, evitiamo ricorsioni infinite
-    if (isChecked.count(Inst)) {
-      return false;
-    }
-
-    // Chiedi se questa istruzione è loop invariant ricorsivamente ai suoi operandi
-    if (IsLoopInvariant(*Inst, L, DT, LoopInvariantInst, isChecked)) {
-      LoopInvariantInst.insert(Inst);
-      return true;
-    }
-    isChecked.insert(Inst);
+    // Se non è dentro il loop è loop invariant, altrimenti deve essere già marcato
+    return !L->contains(Inst) || LoopInvariantInst.count(Inst);
   }
   return false;
 }
 // controlla se un'istruzione è loop invariant
-bool IsLoopInvariant(Instruction &I, Loop *L, DominatorTree &DT,
-  std::set<Instruction*> &LoopInvariantInst,
-  std::set<Instruction*> &isChecked) {
+bool IsLoopInvariant(Instruction &I, Loop *L, MemorySSA &MSSA,
+  const SmallPtrSetImpl<Instruction*> &LoopInvariantInst) {
   // Se non è sicura, viene esclusa a priori
-  if (!isASafeInstruction(&I)) {
+  if (!isASafeInstruction(&I, L, MSSA)) {
     return false;
   }
   // Tutti gli operandi devono essere loop invariant
-  for (unsigned i = 0; i < I.getNumOperands(); ++i) {
-    if (!isOperLoopInvariant(*I.getOperand(i), L, DT, LoopInvariantInst, isChecked)) {
+  return all_of(I.operands(), [&](Value *Op) {
+    return isOperLoopInvariant(*Op, L, LoopInvariantInst);
+  });
+}
+// sposta nel preheader del loop le istruzioni loop invariant che dominano tutte
+// le uscite (o sono morte dopo il loop). I loop interni sono già stati
+// processati, quindi le loro istruzioni invarianti si trovano nei loro preheader,
+// che appartengono a L, e possono salire di un altro livello
+bool hoistLoopInvariants(Loop *L, LoopInfo &LI, DominatorTree &DT, MemorySSAUpdater &MSSAU) {
+  MemorySSA &MSSA = *MSSAU.getMemorySSA();
+  BasicBlock *Preheader = L->getLoopPreheader();
+  if (!Preheader)
+    return false;
+
+  // blocchi da cui si esce dal loop: un'istruzione che domina i loro terminatori
+  // viene eseguita in ogni iterazione che lascia il loop. Nei loop ruotati (guardia
+  // + do-while) l'unico blocco uscente è il latch, dominato dal corpo, mentre il
+  // blocco di uscita può essere condiviso con la guardia e non essere dominato
+  SmallVector<BasicBlock*, 8> ExitingBlocks;
+  L->getExitingBlocks(ExitingBlocks);
+  // unica passata in avanti in reverse post-order sui blocchi del loop: le phi
+  // non sono mai invarianti, quindi ogni operando definito nel loop viene visitato
+  // prima dei suoi usi. Le istruzioni vengono spostate nello stesso ordine, così
+  // ogni definizione arriva nel preheader prima dei suoi usi
+  SmallPtrSet<Instruction*, 32> LoopInvariantInst;
+  // chiamate che possono lanciare eccezioni o non ritornare: ciò che le segue nel loop
+  // non è eseguito di sicuro anche se domina le uscite
+  ICFLoopSafetyInfo SafetyInfo;
+  SafetyInfo.computeLoopSafetyInfo(L);
+  LoopBlocksRPO RPOT(L);
+  RPOT.perform(&LI);
+  bool anyChanges = false;
+  for (BasicBlock *BB : RPOT) {
+    for (Instruction &Inst : make_early_inc_range(*BB)) {
+      Instruction *I = &Inst;
+      if (!IsLoopInvariant(*I, L, MSSA, LoopInvariantInst))
+        continue;
+      LoopInvariantInst.insert(I);
+      if (!dominatesAllUses(I, DT, L))
+        continue;
+      // per ogni istruzione loop invariant controlla se domina tutte le uscite
+      bool dominatesAllExits = true;
+      for (auto *ExitingBB : ExitingBlocks) {
+        if (!DT.dominates(I, ExitingBB->getTerminator())) {
+          dominatesAllExits = false;
+          break;
+        }
+      }
+      // gli operandi definiti nel loop devono essere già stati spostati
+      bool operandsHoisted = all_of(I->operands(), [&](Value *Op) {
+        auto *OpInst = dyn_cast<Instruction>(Op);
+        return !OpInst || !L->contains(OpInst);
+      });
+      // un'istruzione (load, call, divisione, ...) può essere spostata solo se viene
+      // comunque eseguita (domina le uscite di un loop che termina e nessuna istruzione
+      // prima di lei può interrompere l'iterazione) o se non può trappare. Vale anche
+      // per quelle morte dopo il loop: nel preheader verrebbero eseguite comunque
+      bool isExecuted = dominatesAllExits && !ExitingBlocks.empty() &&
+                        SafetyInfo.isGuaranteedToExecute(*I, &DT, L);
+      if (!isExecuted && !isSafeToSpeculativelyExecute(I, Preheader->getTerminator()))
+        continue;
+      // se l'istruzione domina tutti i blocchi di uscita e tutti i suoi usi oppure è morta dopo il loop
+      // allora l'istruzione può essere spostata nel preheader del loop
+      if ((dominatesAllExits || isDeadAfterLoop(I, L)) && operandsHoisted) {
+        // i metadati (range, nonnull, ...) valgono solo dove l'istruzione era eseguita
+        if (!isExecuted)
+          I->dropUnknownNonDebugMetadata();
+        SafetyInfo.removeInstruction(I);
+        I->moveBefore(Preheader->getTerminator());
+        SafetyInfo.insertInstructionTo(I, Preheader);
+        if (MemoryUseOrDef *Access = MSSA.getMemoryAccess(I))
+          MSSAU.moveToPlace(Access, Preheader, MemorySSA::BeforeTerminator);
+        ++NumHoisted;
+        anyChanges = true;
+      }
+    }
+  }
+  return anyChanges;
+}
+// riscrive load e store di una locazione promossa a registro: i valori arrivano
+// dall'SSAUpdater e un'unica store per blocco di uscita scrive il valore finale
+class LoopPromoter : public LoadAndStorePromoter {
+  Value *Ptr;
+  SmallVectorImpl<BasicBlock *> &ExitBlocks;
+  SSAUpdater &SSA;
+  MemorySSAUpdater &MSSAU;
+  Align Alignment;
+
+public:
+  LoopPromoter(ArrayRef<const Instruction *> Insts, SSAUpdater &SSA, Value *Ptr,
+               SmallVectorImpl<BasicBlock *> &ExitBlocks, MemorySSAUpdater &MSSAU,
+               Align Alignment)
+      : LoadAndStorePromoter(Insts, SSA), Ptr(Ptr), ExitBlocks(ExitBlocks),
+        SSA(SSA), MSSAU(MSSAU), Alignment(Alignment) {}
+
+  void doExtraRewritesBeforeFinalDeletion() override {
+    for (BasicBlock *ExitBB : ExitBlocks) {
+      Value *LiveOut = SSA.GetValueInMiddleOfBlock(ExitBB);
+      StoreInst *Store = new StoreInst(LiveOut, Ptr, false, Alignment, &*ExitBB->getFirstInsertionPt());
+      MemoryAccess *Access = MSSAU.createMemoryAccessInBB(Store, nullptr, ExitBB, MemorySSA::Beginning);
+      MSSAU.insertDef(cast<MemoryDef>(Access), true);
+    }
+  }
+
+  void instructionDeleted(Instruction *I) const override { MSSAU.removeMemoryAccess(I); }
+};
+// promuove a registro le locazioni a indirizzo invariante lette e scritte nel loop:
+// una load nel preheader, i valori in SSA dentro al loop, una store in ogni uscita
+bool promoteLoopScalars(Loop *L, DominatorTree &DT, AAResults &AA, MemorySSAUpdater &MSSAU) {
+  BasicBlock *Preheader = L->getLoopPreheader();
+  SmallVector<BasicBlock*, 4> ExitBlocks;
+  L->getUniqueExitBlocks(ExitBlocks);
+  // servono uscite dedicate per non introdurre store su percorsi esterni al loop
+  if (!Preheader || ExitBlocks.empty() || !L->hasDedicatedExits())
+    return false;
+
+  // load/store semplici raggruppate per puntatore, tutti gli altri accessi a parte
+  MapVector<Value*, SmallVector<Instruction*, 4>> Accesses;
+  SmallVector<Instruction*, 16> OtherAccesses;
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      // con un'eccezione il valore non arriverebbe alla store nelle uscite
+      if (I.mayThrow())
+        return false;
+      if (!I.mayReadOrWriteMemory())
+        continue;
+      Value *Ptr = getLoadStorePointerOperand(&I);
+      bool isSimple = isa<LoadInst>(I) ? cast<LoadInst>(I).isSimple()
+                    : isa<StoreInst>(I) && cast<StoreInst>(I).isSimple();
+      if (Ptr && isSimple && L->isLoopInvariant(Ptr))
+        Accesses[Ptr].push_back(&I);
+      else
+        OtherAccesses.push_back(&I);
+    }
+  }
+
+  bool anyChanges = false;
+  for (auto &Entry : Accesses) {
+    Value *Ptr = Entry.first;
+    SmallVectorImpl<Instruction*> &Insts = Entry.second;
+    Type *Ty = getLoadStoreType(Insts.front());
+    Align Alignment = getLoadStoreAlignment(Insts.front());
+    bool hasGuaranteedStore = false;
+    bool isPromotable = true;
+    for (Instruction *I : Insts) {
+      isPromotable &= getLoadStoreType(I) == Ty;
+      Alignment = std::min(Alignment, getLoadStoreAlignment(I));
+      // una store eseguita a ogni uscita rende lecite la load nel preheader e le
+      // store nelle uscite
+      if (isa<StoreInst>(I) && !hasGuaranteedStore)
+        hasGuaranteedStore = all_of(ExitBlocks, [&](BasicBlock *ExitBB) {
+          return DT.dominates(I->getParent(), ExitBB);
+        });
+    }
+    if (!isPromotable || !hasGuaranteedStore)
+      continue;
+
+    // nessun altro accesso del loop può leggere o scrivere la locazione
+    MemoryLocation Loc = MemoryLocation::get(Insts.front());
+    auto mayAccessLoc = [&](Instruction *I) { return isModOrRefSet(AA.getModRefInfo(I, Loc)); };
+    if (any_of(OtherAccesses, mayAccessLoc))
+      continue;
+    bool isAliased = false;
+    for (auto &Other : Accesses)
+      if (Other.first != Ptr && any_of(Other.second, mayAccessLoc))
+        isAliased = true;
+    if (isAliased)
+      continue;
+
+    // il promoter inizializza l'SSAUpdater: il valore del preheader va aggiunto dopo
+    SSAUpdater SSA;
+    SmallVector<const Instruction*, 8> ConstInsts(Insts.begin(), Insts.end());
+    LoopPromoter Promoter(ConstInsts, SSA, Ptr, ExitBlocks, MSSAU, Alignment);
+    LoadInst *PreheaderLoad = new LoadInst(Ty, Ptr, Ptr->getName() + ".promoted", false,
+                                           Alignment, Preheader->getTerminator());
+    MemoryAccess *Access = MSSAU.createMemoryAccessInBB(PreheaderLoad, nullptr, Preheader, MemorySSA::End);
+    MSSAU.insertUse(cast<MemoryUse>(Access), true);
+    SSA.AddAvailableValue(Preheader, PreheaderLoad);
+    Promoter.run(Insts);
+    // load e store promosse sono state cancellate
+    Insts.clear();
+    // senza load nel loop il valore iniziale può non servire
+    if (PreheaderLoad->use_empty()) {
+      MSSAU.removeMemoryAccess(PreheaderLoad);
+      PreheaderLoad->eraseFromParent();
+    }
+    ++NumPromoted;
+    anyChanges = true;
+  }
+  return anyChanges;
+}
+// l'uso U di un'istruzione avviene nel blocco dell'user o, per le phi, alla fine
+// del blocco incoming corrispondente
+BasicBlock *getUseBlock(Use &U) {
+  Instruction *UserInst = cast<Instruction>(U.getUser());
+  if (PHINode *PN = dyn_cast<PHINode>(UserInst))
+    return PN->getIncomingBlock(U);
+  return UserInst->getParent();
+}
+// istruzioni che si possono spostare più in basso senza cambiare la semantica:
+// nessun accesso alla memoria (una load non può scavalcare le store successive)
+bool isSinkable(Instruction *I, Loop *L, MemorySSA &MSSA) {
+  return isASafeInstruction(I, L, MSSA) && !I->mayReadOrWriteMemory() && !I->use_empty();
+}
+// complementare di isDeadAfterLoop: un'istruzione calcolata a ogni iterazione ma
+// usata solo dopo il loop viene calcolata una volta sola nel blocco di uscita che
+// domina i suoi usi (una copia per ogni uscita coinvolta). L'istruzione deve
+// dominare le uscite, così operandi e risultato sono quelli dell'ultima iterazione
+bool sinkToExitBlocks(Instruction *I, Loop *L, DominatorTree &DT,
+                      ArrayRef<BasicBlock*> ExitBlocks) {
+  SmallVector<std::pair<Use*, BasicBlock*>, 8> Uses;
+  // phi di uscita che ricevono I da tutti i predecessori: diventano la copia
+  SmallVector<std::pair<PHINode*, BasicBlock*>, 4> ExitPhis;
+  for (Use &U : I->uses()) {
+    BasicBlock *UseBB = getUseBlock(U);
+    PHINode *PN = dyn_cast<PHINode>(U.getUser());
+    if (PN && is_contained(ExitBlocks, PN->getParent()) && L->contains(UseBB)) {
+      if (!all_of(PN->incoming_values(), [&](Value *V) { return V == I; }))
+        return false;
+      if (none_of(ExitPhis, [&](auto &Entry) { return Entry.first == PN; }))
+        ExitPhis.push_back({PN, PN->getParent()});
+      continue;
+    }
+    if (L->contains(UseBB))
+      return false;
+    auto ExitIt = find_if(ExitBlocks, [&](BasicBlock *ExitBB) { return DT.dominates(ExitBB, UseBB); });
+    if (ExitIt == ExitBlocks.end())
       return false;
+    Uses.push_back({&U, *ExitIt});
+  }
+  auto dominatesExit = [&](auto &Entry) { return DT.dominates(I->getParent(), Entry.second); };
+  if (!all_of(Uses, dominatesExit) || !all_of(ExitPhis, dominatesExit))
+    return false;
+
+  // una copia per uscita, inserita dopo le phi
+  SmallDenseMap<BasicBlock*, Instruction*, 4> Copies;
+  auto getCopy = [&](BasicBlock *ExitBB) {
+    Instruction *&Copy = Copies[ExitBB];
+    if (!Copy) {
+      Copy = I->clone();
+      Copy->insertBefore(&*ExitBB->getFirstInsertionPt());
     }
+    return Copy;
+  };
+  for (auto &Entry : Uses)
+    Entry.first->set(getCopy(Entry.second));
+  for (auto &Entry : ExitPhis) {
+    Entry.first->replaceAllUsesWith(getCopy(Entry.second));
+    Entry.first->eraseFromParent();
+  }
+  // il nome passa alla prima copia, le altre ricevono un suffisso
+  std::string Name = I->getName().str();
+  I->eraseFromParent();
+  for (auto &Entry : Copies)
+    Entry.second->setName(Name);
+  NumSunkToExits += Copies.size();
+  return true;
+}
+// un'istruzione usata solo in un ramo del corpo viene spostata nel blocco che
+// domina tutti i suoi usi, se è eseguito meno spesso di quello di partenza
+bool sinkIntoRareBlock(Instruction *I, Loop *L, LoopInfo &LI, DominatorTree &DT,
+                       BlockFrequencyInfo &BFI) {
+  BasicBlock *Target = nullptr;
+  for (Use &U : I->uses()) {
+    BasicBlock *UseBB = getUseBlock(U);
+    Target = Target ? DT.findNearestCommonDominator(Target, UseBB) : UseBB;
   }
+  if (!Target || Target == I->getParent() || LI.getLoopFor(Target) != L ||
+      BFI.getBlockFreq(Target) >= BFI.getBlockFreq(I->getParent()))
+    return false;
+  I->moveBefore(&*Target->getFirstInsertionPt());
+  ++NumSunkToRareBlocks;
   return true;
 }
+// sinking sui blocchi del loop (non dei sottoloop, già processati) in reverse
+// post-order inverso, così gli user vengono spostati prima dei loro operandi
+bool sinkLoopInstructions(Loop *L, LoopInfo &LI, DominatorTree &DT, MemorySSA &MSSA,
+                          BlockFrequencyInfo &BFI) {
+  SmallVector<BasicBlock*, 8> ExitBlocks;
+  L->getUniqueExitBlocks(ExitBlocks);
+  LoopBlocksRPO RPOT(L);
+  RPOT.perform(&LI);
+  bool anyChanges = false;
+  for (BasicBlock *BB : reverse(RPOT)) {
+    if (LI.getLoopFor(BB) != L)
+      continue;
+    for (Instruction &I : make_early_inc_range(reverse(*BB))) {
+      if (!isSinkable(&I, L, MSSA))
+        continue;
+      anyChanges |= sinkToExitBlocks(&I, L, DT, ExitBlocks) ||
+                    sinkIntoRareBlock(&I, L, LI, DT, BFI);
+    }
+  }
+  return anyChanges;
+}
 // New PM implementation
 struct TestPass: PassInfoMixin<TestPass> {
   // Main entry point, takes IR unit to run the pass on (&F) and the
@@ -151,57 +469,75 @@ struct TestPass: PassInfoMixin<TestPass> {
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
     LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
     DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    AAResults &AA = AM.getResult<AAManager>(F);
+    MemorySSA &MSSA = AM.getResult<MemorySSAAnalysis>(F).getMSSA();
+    MemorySSAUpdater MSSAU(&MSSA);
+    // SCEV viene aggiornata solo se qualcuno l'ha già calcolata
+    ScalarEvolution *SE = AM.getCachedResult<ScalarEvolutionAnalysis>(F);
     bool anyChanges = false;
+    bool cfgChanges = false;
 
     // esce immediatamente se non ci sono loop
     if(LI.empty()) {
       return PreservedAnalyses::all();
     }
-    // per ogni loop della funzione
-    for(auto &L : LI) {
-      std::set<Instruction*> LoopInvariantInst;
-      std::set<Instruction*> isChecked;
-      // aggiungo ad una lista tutte le istruzioni loop invariant
-      for(auto &BB : L->blocks()) {
-        for(auto &I : *BB) {
-          if(IsLoopInvariant(I, L, DT, LoopInvariantInst, isChecked) && dominatesAllUses(&I, DT, L)) {
-            LoopInvariantInst.insert(&I);
-          }
-        }
-      }
-      // calcolo di tutti i blocchi di uscita del loop
-      std::set<BasicBlock*> ExitBlocks = {};
-      for(auto &BB : L->blocks()) {
-        for (auto *Succ : successors(BB)) {
-          if (!L->contains(Succ)) {
-            ExitBlocks.insert(Succ);
-            break;
-          }
-        }
+    // i loop senza preheader o senza uscite dedicate vengono portati in forma
+    // loop-simplify invece di essere saltati
+    for (Loop *L : LI.getLoopsInPreorder())
+      if (!L->isLoopSimplifyForm())
+        ++NumLoopsSimplified;
+    SmallVector<Loop *, 8> TopLevelLoops(LI.begin(), LI.end());
+    for (Loop *L : TopLevelLoops)
+      cfgChanges |= simplifyLoop(L, &DT, &LI, SE, &AM.getResult<AssumptionAnalysis>(F),
+                                 &MSSAU, false);
+    // i loop vengono visitati dal più interno al più esterno (preordine inverso
+    // sull'albero dei loop): un'istruzione sale livello per livello finché resta
+    // invariante, anche se non lo è rispetto al loop più esterno
+    SmallVector<Loop *, 8> Loops = LI.getLoopsInPreorder();
+    // frequenze calcolate dopo loop-simplify, che può aver aggiunto blocchi
+    BranchProbabilityInfo BPI(F, LI);
+    BlockFrequencyInfo BFI(F, BPI, LI);
+    unsigned Examined = 0, Transformed = 0;
+    for (Loop *L : reverse(Loops)) {
+      ++NumLoopsExamined;
+      ++Examined;
+      if (!L->getLoopPreheader()) {
+        ++NumLoopsNoPreheader;
+        continue;
       }
-      // per ogni istruzione loop invariant controlla se domina tutti i blocchi di uscita
-      // e se domina tutti i suoi usi
-      for(auto *I : LoopInvariantInst) {
-        bool dominatesAllExits = true;
-        for (auto *ExitBB : ExitBlocks) {
-          if (!DT.dominates(I, ExitBB)) {
-            dominatesAllExits = false;
-            break;
-          }
-        }
-        // se l'istruzione domina tutti i blocchi di uscita e tutti i suoi usi oppure è morta dopo il loop
-        // allora l'istruzione può essere spostata nel preheader del loop
-        if ((dominatesAllExits || isDeadAfterLoop(I, L))) {
-          BasicBlock *Preheader = L->getLoopPreheader();
-          if (Preheader) {
-            I->moveBefore(Preheader->getTerminator());
-            anyChanges = true;
-          }
-        }
+      bool loopChanged = hoistLoopInvariants(L, LI, DT, MSSAU);
+      loopChanged |= promoteLoopScalars(L, DT, AA, MSSAU);
+      loopChanged |= sinkLoopInstructions(L, LI, DT, MSSA, BFI);
+      if (loopChanged) {
+        ++NumLoopsTransformed;
+        ++Transformed;
       }
+      anyChanges |= loopChanged;
     }
-    if(anyChanges) return PreservedAnalyses::none();
-    else return PreservedAnalyses::all();
+    // riepilogo della copertura anche senza statistiche abilitate:
+    // opt -pass-remarks-analysis=loop-inv
+    AM.getResult<OptimizationRemarkEmitterAnalysis>(F).emit([&]() {
+      return OptimizationRemarkAnalysis(DEBUG_TYPE, "Coverage", &F)
+             << "loop esaminati: " << ore::NV("Examined", Examined)
+             << ", trasformati: " << ore::NV("Transformed", Transformed);
+    });
+
+    if (!anyChanges && !cfgChanges)
+      return PreservedAnalyses::all();
+
+    // le istruzioni spostate dentro o fuori dai loop cambiano le loop disposition
+    if (SE)
+      SE->forgetLoopDispositions();
+    // hoisting, promozione e sinking non toccano il CFG; loop-simplify aggiunge
+    // preheader e uscite aggiornando DT, LoopInfo, MemorySSA e SCEV, ma non il PDT
+    PreservedAnalyses PA;
+    if (!cfgChanges)
+      PA.preserveSet<CFGAnalyses>();
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    PA.preserve<MemorySSAAnalysis>();
+    PA.preserve<ScalarEvolutionAnalysis>();
+    return PA;
 }
 
 
@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+# Genera una funzione con un solo loop di circa N istruzioni, metà invarianti e metà
+# no, per misurare come LoopInvariant scala con la dimensione del loop.
+#
+#   python3 gen_halfinv.py [N] > halfinv.ll
+#   opt -load-pass-plugin=<path-to>libLoopInv.so -passes=loop-inv \
+#     -disable-output -time-passes halfinv.ll
+#
+# Il corpo alterna due catene di dipendenze lunghe N/2: %inv<k> dipende solo dagli
+# argomenti e dall'invariante precedente e va spostata nel preheader, %var<k> dipende
+# dall'accumulatore del loop e da %inv<k> e resta nel loop. Le catene lunghe sono il
+# caso peggiore per un'analisi ricorsiva sugli operandi.
+import sys
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 10000
+HALF = max(1, N // 2)
+OPS = ["add", "xor", "mul", "or"]
+
+out = ["define i32 @halfinv(i32 %a, i32 %b, i32 %n) {",
+       "entry:",
+       "  br label %loop",
+       "loop:",
+       "  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]",
+       "  %acc = phi i32 [ %a, %entry ], [ %var" + str(HALF - 1) + ", %loop ]"]
+inv, var = "%b", "%acc"
+for k in range(HALF):
+    op = OPS[k % len(OPS)]
+    out.append(f"  %inv{k} = {op} i32 {inv}, %a")
+    out.append(f"  %var{k} = add i32 {var}, %inv{k}")
+    inv, var = f"%inv{k}", f"%var{k}"
+out += ["  %i.next = add nuw nsw i32 %i, 1",
+        "  %c = icmp slt i32 %i.next, %n",
+        "  br i1 %c, label %loop, label %exit",
+        "exit:",
+        f"  %r = phi i32 [ {var}, %loop ]",
+        "  ret i32 %r",
+        "}"]
+print("\n".join(out))
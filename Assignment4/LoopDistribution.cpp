@@ -0,0 +1,486 @@
+//=============================================================================
+// FILE:
+//    LoopDistribution.cpp
+//
+// DESCRIPTION:
+//    Loop distribution (fission), il contrario della Loop Fusion: il corpo di un
+//    loop innermost viene diviso in più loop consecutivi, così le parti che non
+//    bloccano il vectorizer (dipendenze portate dal loop, chiamate) finiscono in
+//    loop separati da quelle che lo bloccano.
+//    Le istruzioni del corpo formano un grafo di dipendenze (def-use e memoria,
+//    con le direzioni di DependenceAnalysis); le sue componenti fortemente
+//    connesse, in ordine topologico, vengono raggruppate in partizioni e ogni
+//    partizione diventa una copia del loop da cui sono tolte le istruzioni
+//    delle altre. Il controllo del loop (induzione, condizioni dei branch) e i
+//    calcoli senza effetti collaterali sono replicati dove servono.
+//
+// USAGE:
+//    New PM
+//      opt -load-pass-plugin=<path-to>libLoDi.so -passes="lodi" `\`
+//        -disable-output <input-llvm-file>
+//
+//
+// License: MIT
+//=============================================================================
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/IVDescriptors.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+namespace {
+
+class LoopDistributor {
+  Loop *L;
+  LoopInfo &LI;
+  DominatorTree &DT;
+  ScalarEvolution &SE;
+  DependenceInfo &DI;
+  AAResults &AA;
+
+  // istruzioni da cui dipendono i branch del loop: stanno in ogni copia
+  SmallPtrSet<Instruction *, 16> Control;
+  // nodi del grafo: le altre istruzioni del corpo, in ordine di programma
+  SmallVector<Instruction *, 32> Nodes;
+  DenseMap<Instruction *, unsigned> NodeIdx;
+  SmallVector<SmallVector<unsigned, 4>, 32> Succs;
+  SmallVector<bool, 32> SelfEdge;
+  SmallVector<bool, 32> MemoryCycle;
+  SmallVector<bool, 32> MemoryDep;
+
+  // componenti fortemente connesse (Tarjan): escono in ordine topologico inverso
+  SmallVector<SmallVector<unsigned, 4>, 16> SCCs;
+  SmallVector<unsigned, 32> SCCOf, Index, LowLink;
+  SmallVector<unsigned, 32> Stack;
+  SmallVector<bool, 32> OnStack;
+  unsigned NextIndex = 0;
+
+  // le istruzioni di memoria e quelle nei cicli vanno in una sola partizione, i calcoli
+  // puri fuori dai cicli vengono replicati nelle partizioni che li usano. Anche una load
+  // senza dipendenze da scritture del loop legge lo stesso valore in ogni copia.
+  SmallVector<bool, 32> Anchored;
+  SmallVector<unsigned, 32> PartOf;
+  SmallVector<bool, 8> Blocking;
+  unsigned NumParts = 0;
+
+  void addEdge(unsigned From, unsigned To) {
+    if (From == To)
+      SelfEdge[From] = true;
+    else
+      Succs[From].push_back(To);
+  }
+
+  // Dipendenza di memoria fra I e J, con I che precede J nel corpo. Se l'istanza di I
+  // viene eseguita prima (stessa iterazione o precedente) l'arco va da I a J, se viene
+  // eseguita dopo va da J a I; una dipendenza di cui non si conosce la direzione li
+  // mette nello stesso ciclo.
+  void addMemoryEdges(unsigned I, unsigned J) {
+    Instruction *Src = Nodes[I];
+    Instruction *Dst = Nodes[J];
+    if (!Src->mayWriteToMemory() && !Dst->mayWriteToMemory())
+      return;
+    bool Forward = true, Backward = true;
+    if (isa<CallBase>(Src) || isa<CallBase>(Dst)) {
+      // DependenceAnalysis non analizza le chiamate, AA può almeno escluderle
+      ModRefInfo MR = isa<CallBase>(Src) && isa<CallBase>(Dst)
+                          ? AA.getModRefInfo(cast<CallBase>(Src), cast<CallBase>(Dst))
+                      : isa<CallBase>(Src)
+                          ? AA.getModRefInfo(Src, MemoryLocation::get(Dst))
+                          : AA.getModRefInfo(Dst, MemoryLocation::get(Src));
+      if (isNoModRef(MR))
+        return;
+    } else {
+      auto D = DI.depends(Src, Dst, true);
+      if (!D)
+        return;
+      unsigned Level = D->getLevels();
+      if (!D->isConfused() && Level) {
+        unsigned Dir = D->getDirection(Level);
+        Forward = Dir & (Dependence::DVEntry::LT | Dependence::DVEntry::EQ);
+        Backward = Dir & Dependence::DVEntry::GT;
+      }
+    }
+    MemoryDep[I] = MemoryDep[J] = true;
+    if (Forward)
+      addEdge(I, J);
+    if (Backward) {
+      addEdge(J, I);
+      MemoryCycle[I] = MemoryCycle[J] = true;
+    }
+  }
+
+  void strongConnect(unsigned N) {
+    Index[N] = LowLink[N] = NextIndex++;
+    Stack.push_back(N);
+    OnStack[N] = true;
+    for (unsigned S : Succs[N]) {
+      if (Index[S] == ~0U) {
+        strongConnect(S);
+        LowLink[N] = std::min(LowLink[N], LowLink[S]);
+      } else if (OnStack[S]) {
+        LowLink[N] = std::min(LowLink[N], Index[S]);
+      }
+    }
+    if (LowLink[N] != Index[N])
+      return;
+    SmallVector<unsigned, 4> &SCC = SCCs.emplace_back();
+    unsigned M;
+    do {
+      M = Stack.pop_back_val();
+      OnStack[M] = false;
+      SCCOf[M] = SCCs.size() - 1;
+      SCC.push_back(M);
+    } while (M != N);
+  }
+
+  bool isCyclic(ArrayRef<unsigned> SCC) { return SCC.size() > 1 || SelfEdge[SCC.front()]; }
+
+  // Stima se una componente impedisce la vettorizzazione: un ciclo che passa per la
+  // memoria, un ciclo di phi che non sono induzioni o riduzioni, una chiamata
+  bool isBlocking(ArrayRef<unsigned> SCC) {
+    for (unsigned N : SCC) {
+      Instruction *I = Nodes[N];
+      if (isa<CallBase>(I) && !isa<IntrinsicInst>(I))
+        return true;
+      if (!isCyclic(SCC))
+        continue;
+      if (MemoryCycle[N])
+        return true;
+      if (auto *Phi = dyn_cast<PHINode>(I)) {
+        InductionDescriptor ID;
+        RecurrenceDescriptor RD;
+        if (Phi->getParent() != L->getHeader() ||
+            (!InductionDescriptor::isInductionPHI(Phi, L, &SE, ID) &&
+             !RecurrenceDescriptor::isReductionPHI(Phi, L, RD)))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  bool buildGraph() {
+    SmallVector<Instruction *, 16> Writes;
+    for (BasicBlock *BB : L->getBlocks())
+      for (Instruction &I : *BB)
+        if (I.mayWriteToMemory())
+          Writes.push_back(&I);
+
+    // Controllo: chiusura all'indietro delle condizioni dei branch dentro il loop
+    SmallVector<Instruction *, 16> Worklist;
+    for (BasicBlock *BB : L->getBlocks())
+      Worklist.push_back(BB->getTerminator());
+    while (!Worklist.empty()) {
+      Instruction *I = Worklist.pop_back_val();
+      if (!Control.insert(I).second)
+        continue;
+      // il controllo viene duplicato in ogni copia: niente effetti collaterali, e solo
+      // load di memoria che il loop non scrive
+      if (auto *Load = dyn_cast<LoadInst>(I); Load && Load->isSimple()) {
+        if (any_of(Writes, [&](Instruction *W) {
+              return isModSet(AA.getModRefInfo(W, MemoryLocation::get(Load)));
+            }))
+          return false;
+      } else if (I->mayReadOrWriteMemory() || I->mayHaveSideEffects()) {
+        return false;
+      }
+      for (Value *Op : I->operands())
+        if (auto *OpI = dyn_cast<Instruction>(Op); OpI && L->contains(OpI))
+          Worklist.push_back(OpI);
+    }
+
+    LoopBlocksRPO RPOT(L);
+    RPOT.perform(&LI);
+    for (BasicBlock *BB : RPOT) {
+      for (Instruction &I : *BB) {
+        if (Control.count(&I))
+          continue;
+        // cambiando l'ordine fra le iterazioni un'istruzione che non ritorna o lancia
+        // un'eccezione lascerebbe effetti che il loop originale non avrebbe prodotto
+        if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+          return false;
+        if (I.mayReadOrWriteMemory() && !isa<CallBase>(I)) {
+          auto *Load = dyn_cast<LoadInst>(&I);
+          auto *Store = dyn_cast<StoreInst>(&I);
+          if (!(Load && Load->isSimple()) && !(Store && Store->isSimple()))
+            return false;
+        }
+        NodeIdx[&I] = Nodes.size();
+        Nodes.push_back(&I);
+      }
+    }
+
+    unsigned N = Nodes.size();
+    Succs.resize(N);
+    SelfEdge.assign(N, false);
+    MemoryCycle.assign(N, false);
+    MemoryDep.assign(N, false);
+    for (unsigned U = 0; U < N; ++U)
+      for (Value *Op : Nodes[U]->operands())
+        if (auto *OpI = dyn_cast<Instruction>(Op); OpI && NodeIdx.count(OpI))
+          addEdge(NodeIdx[OpI], U);
+    for (unsigned I = 0; I < N; ++I)
+      if (Nodes[I]->mayReadOrWriteMemory())
+        for (unsigned J = I + 1; J < N; ++J)
+          if (Nodes[J]->mayReadOrWriteMemory())
+            addMemoryEdges(I, J);
+    return true;
+  }
+
+  // Le componenti con effetti o cicli, in ordine topologico, formano le partizioni:
+  // quelle consecutive dello stesso tipo (bloccanti o no) vengono unite
+  void partition() {
+    unsigned N = Nodes.size();
+    SCCOf.assign(N, 0);
+    Index.assign(N, ~0U);
+    LowLink.assign(N, 0);
+    OnStack.assign(N, false);
+    for (unsigned I = 0; I < N; ++I)
+      if (Index[I] == ~0U)
+        strongConnect(I);
+
+    Anchored.assign(N, false);
+    SmallVector<unsigned, 16> SCCPart(SCCs.size(), ~0U);
+    for (auto &SCC : reverse(SCCs)) {
+      Instruction *I = Nodes[SCC.front()];
+      bool Anchor = isCyclic(SCC) || I->mayHaveSideEffects() ||
+                    (I->mayReadOrWriteMemory() && (!isa<LoadInst>(I) || MemoryDep[SCC.front()]));
+      if (!Anchor)
+        continue;
+      bool Block = isBlocking(SCC);
+      if (!NumParts || Blocking.back() != Block) {
+        Blocking.push_back(Block);
+        ++NumParts;
+      }
+      for (unsigned M : SCC) {
+        Anchored[M] = true;
+        SCCPart[SCCOf[M]] = NumParts - 1;
+      }
+    }
+    PartOf.assign(N, ~0U);
+    for (unsigned I = 0; I < N; ++I)
+      if (Anchored[I])
+        PartOf[I] = SCCPart[SCCOf[I]];
+  }
+
+  // Un valore ancorato deve stare nella stessa partizione di chi lo usa (anche attraverso
+  // calcoli replicati), e nell'ultima se è usato dopo il loop: le partizioni in mezzo
+  // vengono unite. Ritorna la nuova numerazione delle partizioni.
+  SmallVector<unsigned, 8> mergePartitions() {
+    SmallVector<bool, 8> Cut(NumParts, true);
+    for (unsigned X = 0; X < Nodes.size(); ++X) {
+      if (!Anchored[X])
+        continue;
+      unsigned Last = PartOf[X];
+      SmallVector<Instruction *, 8> Worklist = {Nodes[X]};
+      SmallPtrSet<Instruction *, 8> Visited;
+      while (!Worklist.empty()) {
+        Instruction *I = Worklist.pop_back_val();
+        for (User *U : I->users()) {
+          auto *UI = cast<Instruction>(U);
+          if (!L->contains(UI)) {
+            Last = NumParts - 1;
+            continue;
+          }
+          auto It = NodeIdx.find(UI);
+          if (It == NodeIdx.end() || !Visited.insert(UI).second)
+            continue;
+          if (Anchored[It->second])
+            Last = std::max(Last, PartOf[It->second]);
+          else
+            Worklist.push_back(UI);
+        }
+      }
+      for (unsigned P = PartOf[X]; P < Last; ++P)
+        Cut[P] = false;
+    }
+
+    SmallVector<unsigned, 8> NewPart(NumParts);
+    SmallVector<bool, 8> NewBlocking;
+    for (unsigned P = 0, Q = 0; P < NumParts; ++P) {
+      NewPart[P] = Q;
+      if (NewBlocking.size() == Q)
+        NewBlocking.push_back(false);
+      NewBlocking[Q] = NewBlocking[Q] || Blocking[P];
+      if (Cut[P])
+        ++Q;
+    }
+    Blocking = NewBlocking;
+    NumParts = Blocking.size();
+    return NewPart;
+  }
+
+  // Istruzioni che la partizione P tiene: le sue ancorate e i calcoli replicati che servono
+  // a loro (e, per l'ultima, quelli usati dopo il loop)
+  SmallPtrSet<Instruction *, 32> getKeptInstructions(unsigned P) {
+    SmallPtrSet<Instruction *, 32> Kept;
+    SmallVector<Instruction *, 16> Worklist;
+    for (unsigned I = 0; I < Nodes.size(); ++I) {
+      if (Anchored[I] ? PartOf[I] == P
+                      : P == NumParts - 1 && any_of(Nodes[I]->users(), [&](User *U) {
+                          return !L->contains(cast<Instruction>(U));
+                        }))
+        Worklist.push_back(Nodes[I]);
+    }
+    while (!Worklist.empty()) {
+      Instruction *I = Worklist.pop_back_val();
+      if (!Kept.insert(I).second)
+        continue;
+      for (Value *Op : I->operands())
+        if (auto *OpI = dyn_cast<Instruction>(Op); OpI && NodeIdx.count(OpI))
+          Worklist.push_back(OpI);
+    }
+    return Kept;
+  }
+
+  void removeOthers(const SmallPtrSetImpl<Instruction *> &Kept, ValueToValueMapTy *VMap) {
+    SmallVector<Instruction *, 16> Dead;
+    for (Instruction *I : Nodes)
+      if (!Kept.count(I))
+        Dead.push_back(VMap ? cast<Instruction>((*VMap)[I]) : I);
+    for (Instruction *I : Dead)
+      I->replaceAllUsesWith(PoisonValue::get(I->getType()));
+    for (Instruction *I : Dead)
+      I->eraseFromParent();
+  }
+
+public:
+  LoopDistributor(Loop *L, LoopInfo &LI, DominatorTree &DT, ScalarEvolution &SE,
+                  DependenceInfo &DI, AAResults &AA)
+      : L(L), LI(LI), DT(DT), SE(SE), DI(DI), AA(AA) {}
+
+  // Ritorna il numero di loop prodotti (0 se il loop resta com'è)
+  unsigned run() {
+    if (!L->isInnermost() || !L->isLoopSimplifyForm() || !L->getExitingBlock() ||
+        !L->getExitBlock() || !L->isLCSSAForm(DT))
+      return 0;
+    if (!buildGraph())
+      return 0;
+    partition();
+    if (NumParts < 2)
+      return 0;
+    SmallVector<unsigned, 8> NewPart = mergePartitions();
+    for (unsigned I = 0; I < Nodes.size(); ++I)
+      if (Anchored[I])
+        PartOf[I] = NewPart[PartOf[I]];
+    // conviene solo se separa una parte vettorizzabile da una che non lo è
+    if (NumParts < 2 || none_of(Blocking, [](bool B) { return B; }) ||
+        all_of(Blocking, [](bool B) { return B; }))
+      return 0;
+
+    SmallVector<SmallPtrSet<Instruction *, 32>, 4> Kept;
+    for (unsigned P = 0; P < NumParts; ++P)
+      Kept.push_back(getKeptInstructions(P));
+
+    SE.forgetLoop(L);
+    // Preheader vuoto e con un solo predecessore, come per la fusione
+    BasicBlock *PH = L->getLoopPreheader();
+    if (!PH->getSinglePredecessor() || &PH->front() != PH->getTerminator())
+      PH = SplitBlock(PH, PH->getTerminator(), &DT, &LI);
+    BasicBlock *Pred = PH->getSinglePredecessor();
+    BasicBlock *Exit = L->getExitBlock();
+
+    // Il loop originale resta l'ultima partizione, le altre sono copie messe prima:
+    // l'uscita di ogni copia diventa il preheader della copia successiva
+    BasicBlock *TopPH = PH;
+    for (unsigned P = NumParts - 1; P-- > 0;) {
+      ValueToValueMapTy VMap;
+      SmallVector<BasicBlock *, 8> Blocks;
+      Loop *NewLoop = cloneLoopWithPreheader(TopPH, Pred, L, VMap, ".ldist" + Twine(P), &LI,
+                                             &DT, Blocks);
+      VMap[Exit] = TopPH;
+      remapInstructionsInBlocks(Blocks, VMap);
+      removeOthers(Kept[P], &VMap);
+      TopPH = NewLoop->getLoopPreheader();
+    }
+    Pred->getTerminator()->replaceUsesOfWith(PH, TopPH);
+    removeOthers(Kept[NumParts - 1], nullptr);
+    DT.recalculate(*PH->getParent());
+    return NumParts;
+  }
+};
+
+// New PM implementation
+struct LoopDistribution: PassInfoMixin<LoopDistribution> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+    AAResults &AA = AM.getResult<AAManager>(F);
+    OptimizationRemarkEmitter &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+    // le copie create vengono aggiunte a LoopInfo: si lavora sui loop di partenza
+    SmallVector<Loop *, 8> Loops;
+    for (Loop *L : LI.getLoopsInPreorder())
+      if (L->isInnermost())
+        Loops.push_back(L);
+
+    bool anyChanges = false;
+    for (Loop *L : Loops) {
+      DebugLoc Loc = L->getStartLoc();
+      unsigned NumLoops = LoopDistributor(L, LI, DT, SE, DI, AA).run();
+      if (!NumLoops)
+        continue;
+      anyChanges = true;
+      ORE.emit([&]() {
+        return OptimizationRemark("lodi", "Distributed", Loc, L->getHeader())
+               << "loop distribuito in " << ore::NV("NumLoops", NumLoops) << " loop";
+      });
+    }
+
+    if (!anyChanges)
+      return PreservedAnalyses::all();
+
+    // LoopInfo aggiornato da cloneLoopWithPreheader, DT ricalcolato, SCEV dimenticato
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    PA.preserve<ScalarEvolutionAnalysis>();
+    return PA;
+  }
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+};
+} // namespace
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+llvm::PassPluginLibraryInfo getTestPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "LoDi", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "lodi") {
+                    FPM.addPass(LoopDistribution());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+// This is the core interface for pass plugins. It guarantees that 'opt' will
+// be able to recognize LoopDistribution when added to the pass pipeline on the
+// command line, i.e. via '-passes=lodi'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getTestPassPluginInfo();
+}
@@ -7,6 +7,20 @@
 #include "llvm/Analysis/DependenceAnalysis.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopPeel.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Analysis/IVDescriptors.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/ADT/SetVector.h"
 
 
 using namespace llvm;
@@ -98,40 +112,32 @@ bool isDomPostDom(std::pair<Loop*, Loop*> LPair, Function &F, FunctionAnalysisMa
 
   return DT.dominates(FirstEntry, SecondEntry) && PDT.dominates(SecondEntry, FirstEntry);
 }
-// Restituisce un insieme di paia di loops, il primo è il loop "sopra", il secondo il loop "sotto".
-// I loop candidati sono quei loop che insieme soddisfano l'adiacenza e la dominanza e post dominanza.
-// Il risultato finale è un insieme di coppie di loop pronti per i controlli successivi
-std::set<std::pair<Loop*, Loop*>> getLoopCandidates(Function &F, FunctionAnalysisManager &AM) {
-  LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
-  std::set<std::pair<Loop*, Loop*>> LoopCandidates;
-  Loop *LastGood = nullptr;
-
-  // Guardando i loop in depth first...
-  for (Loop *L : LI.getLoopsInPreorder()) {
-    // ...se il loop non è una foglia continua la discesa
-    if (!L->isInnermost()){
-      LastGood = nullptr;
+// Numero massimo di iterazioni staccate dall'inizio del primo loop per allinearlo al secondo
+const unsigned MaxPeelCount = 8;
+
+// Cerca una variabile d'induzione per loop (phi dell'header con SCEV affine e passo costante)
+// tali che, dopo Peel iterazioni di L1, le due partano dallo stesso valore con lo stesso passo:
+// in quel caso alla stessa iterazione del loop fuso valgono uguale e L2 può usare quella di L1
+std::pair<PHINode*, PHINode*> getAlignedIVs(Loop *L1, Loop *L2, ScalarEvolution &SE, unsigned Peel = 0) {
+  for (PHINode &PN1 : L1->getHeader()->phis()) {
+    auto *AR1 = PN1.getType()->isIntegerTy() ? dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&PN1)) : nullptr;
+    if (!AR1 || AR1->getLoop() != L1 || !AR1->isAffine() || !isa<SCEVConstant>(AR1->getStepRecurrence(SE)))
       continue;
-    }
+    const SCEV *Start1 = AR1->evaluateAtIteration(SE.getConstant(PN1.getType(), Peel), SE);
 
-    if (LastGood) { // LastGood è la foglia sibling al loop corrente
-      if (!isLoopAdjacent({LastGood, L})) { // Se il loop corrente non è adiacente con quello precedente
-        LastGood = L;                       // allora il loop precedente è scartato
+    for (PHINode &PN2 : L2->getHeader()->phis()) {
+      if (PN2.getType() != PN1.getType())
         continue;
-      }
-
-      if (isDomPostDom({LastGood, L}, F, AM)) {             // Se il loop corrente soddisfa entrambe le condizioni
-        LoopCandidates.insert(std::make_pair(LastGood, L)); // allora il paio è creato e LastGood è consumato
-        LastGood = nullptr;
-        continue;
-      }
+      auto *AR2 = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&PN2));
+      if (AR2 && AR2->getLoop() == L2 && AR2->isAffine() &&
+          AR2->getStepRecurrence(SE) == AR1->getStepRecurrence(SE) && AR2->getStart() == Start1)
+        return {&PN1, &PN2};
     }
-    LastGood = L;
   }
-  return LoopCandidates;
+  return {nullptr, nullptr};
 }
-// Controlla che i due loops abbiano lo stesso trip count (per semplicità si controllano solo i loop canonici, ovvero
-// non si controllano i casi tipo int i = 0; i < 10 con j = 4; j < 14
+// Controlla che i due loops abbiano lo stesso trip count e una variabile d'induzione allineata
+// (ad es. int i = 0; i < 10 con j = 0; j < 10, ma anche i = 4; i < 14 con j = 4; j < 14)
 bool haveSameTripCount(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager &AM) {
   ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
   const SCEV *C1 = SE.getBackedgeTakenCount(L1);
@@ -140,88 +146,458 @@ bool haveSameTripCount(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager
   if (isa<SCEVCouldNotCompute>(C1) || isa<SCEVCouldNotCompute>(C2))
     return false;
   
-  if(L1->getCanonicalInductionVariable() && L2->getCanonicalInductionVariable())
-    return C1 == C2;
-  
-  return false; // Se almeno uno dei due loop non è canonico, si assume in modo conservativo che non siano compatibili
+  return C1 == C2 && getAlignedIVs(L1, L2, SE).first; // Senza induzioni allineate si assume in modo conservativo che non siano compatibili
 }
-// Cerca ricorsivamente di trovare la distanza fra due induzioni (il calcolo fra le distanze di due SCEV fra loop diversi
-// necessita di una visita ricorsiva)
-const SCEVConstant* getConstantStart(const SCEV *S) {
-    if (auto *Const = dyn_cast<SCEVConstant>(S)) { // Caso base: è una costante e l'induzione è stata trovata
-        return Const;
-    } else if (auto *AddRec = dyn_cast<SCEVAddRecExpr>(S)) { // Caso ricorsivo
-        return getConstantStart(AddRec->getStart());
-    }
-    return nullptr; // non è costante né AddRecExpr
+// Due nidi sono conformi se hanno la stessa struttura (un solo loop per livello) e, livello per
+// livello sotto quello da fondere, lo stesso trip count: solo così, fusi i loop esterni, anche
+// quelli interni si possono fondere e il nido viene attraversato una volta sola
+bool areConformingNests(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager &AM) {
+  while (!L1->isInnermost() || !L2->isInnermost()) {
+    if (L1->getSubLoops().size() != 1 || L2->getSubLoops().size() != 1)
+      return false;
+    L1 = L1->getSubLoops().front();
+    L2 = L2->getSubLoops().front();
+    if (!haveSameTripCount(L1, L2, F, AM))
+      return false;
+  }
+  return true;
 }
-// Continuo della funzione "hasNegativeDistance": Date due istruzioni, ne calcola la distanza partendo
-// dalle store e load.
-bool isThereNegativeDistance(StoreInst *I1, LoadInst *I2, ScalarEvolution &SE){
-  Value *PtrSt;
-  Value *PtrLd;
-
-  // Ottengo i puntatori delle rispettive store e load
-  auto *Store = I1;
-  PtrSt = Store->getPointerOperand();
-  auto *Load = I2;
-  PtrLd = Load->getPointerOperand();
-
-  // Dai loro puntatori, ne traggo il loro n-esimo operando, ovvero l'offset di salto
-  auto *GEPst = dyn_cast<GetElementPtrInst>(PtrSt);
-  Value *IndexSt = GEPst->getOperand(GEPst->getNumOperands() - 1); 
-  auto *GEPld = dyn_cast<GetElementPtrInst>(PtrLd);
-  Value *IndexLd = GEPld->getOperand(GEPld->getNumOperands() - 1);
-
-  const SCEV *S1 = SE.getSCEV(IndexSt);
-  const SCEV *S2 = SE.getSCEV(IndexLd);
-
-  // Se è una costante negativa allora la distanza è negativa
-  const SCEV *distance = SE.getMinusSCEV(S1, S2);
-  // Bisogna ricercare ricorsivamente il valore costante della distanza
-  if (auto *AddRec = dyn_cast<SCEVAddRecExpr>(distance)) {
-    const SCEVConstant *ConstStart = getConstantStart(AddRec->getStart());
-    if (ConstStart) {
-      int64_t startVal = ConstStart->getValue()->getSExtValue();
-      return startVal < 0;
+// Restituisce un insieme di paia di loops, il primo è il loop "sopra", il secondo il loop "sotto".
+// I loop candidati sono quei loop che insieme soddisfano l'adiacenza e la dominanza e post dominanza.
+// Il risultato finale è una lista di coppie di loop pronti per i controlli successivi, nell'ordine
+// del programma: staccare iterazioni dall'inizio di un loop non deve separarlo dal precedente.
+// Le coppie sono fra fratelli a qualsiasi profondità: due nidi conformi vengono fusi dal livello
+// esterno, i loro loop interni diventano fratelli adiacenti e vengono fusi ai giri successivi
+SmallVector<std::pair<Loop*, Loop*>, 8> getLoopCandidates(Function &F, FunctionAnalysisManager &AM) {
+  LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+  SmallVector<std::pair<Loop*, Loop*>, 8> LoopCandidates;
+  // Per ogni padre (nullptr per i loop esterni) l'ultimo figlio visto: in preordine i fratelli
+  // arrivano nell'ordine del programma
+  DenseMap<Loop*, Loop*> LastSibling;
+
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    Loop *&LastGood = LastSibling[L->getParentLoop()];  // LastGood è il fratello precedente al loop corrente
+    if (LastGood && isLoopAdjacent({LastGood, L}) &&    // Se il loop corrente è adiacente con quello precedente,
+        isDomPostDom({LastGood, L}, F, AM) &&           // soddisfa dominanza e post dominanza
+        areConformingNests(LastGood, L, F, AM))         // e i due nidi hanno la stessa forma, il paio è creato;
+      LoopCandidates.push_back(std::make_pair(LastGood, L)); // L resta candidato col successivo nel caso
+    LastGood = L;                                            // questo paio non superi i controlli
+  }
+  return LoopCandidates;
+}
+// Trip count diversi: se L1 fa Peel iterazioni in più di L2 e, staccate quelle, le induzioni si
+// allineano (ad es. int i = 0; i < n con j = 1; j < n) ritorna Peel, altrimenti 0.
+// Come in LoopFuse di LLVM servono trip count costanti: solo così le iterazioni staccate sono
+// sicuramente eseguite e non servono guardie diverse per i due loop
+unsigned getPeelCount(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager &AM) {
+  ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+  unsigned TC1 = SE.getSmallConstantTripCount(L1);
+  unsigned TC2 = SE.getSmallConstantTripCount(L2);
+  if (!TC1 || !TC2 || TC1 <= TC2 || TC1 - TC2 > MaxPeelCount)
+    return 0;
+
+  // peelLoop lavora solo su loop ruotati; con le guardie, staccate le iterazioni, L1 e L2
+  // avrebbero condizioni d'ingresso diverse. I nidi non vengono staccati
+  if (!L1->isInnermost() || L1->isGuarded() || L2->isGuarded() || !canPeel(L1))
+    return 0;
+
+  unsigned Peel = TC1 - TC2;
+  return getAlignedIVs(L1, L2, SE, Peel).first ? Peel : 0;
+}
+// Stacca le prime Peel iterazioni di L1 con peelLoop. Le copie escono dal loop solo se il trip
+// count è minore di Peel, cosa esclusa da getPeelCount: i loro salti d'uscita diventano
+// incondizionati, così l'uscita di L1 torna a essere il preheader di L2 e i loop restano adiacenti
+bool peelFirstLoop(Loop *L1, Loop *L2, unsigned Peel, Function &F, FunctionAnalysisManager &AM) {
+  DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+  PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+  LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+  ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+  AssumptionCache &AC = AM.getResult<AssumptionAnalysis>(F);
+  BasicBlock *P2 = L2->getLoopPreheader();
+
+  ValueToValueMapTy VMap;
+  if (!peelLoop(L1, Peel, &LI, &SE, DT, &AC, L1->isLCSSAForm(DT), VMap))
+    return false;
+
+  // peelLoop ha rimesso L1 in forma simplified: la nuova uscita dedicata porta a P2,
+  // dove arrivano anche le uscite delle copie
+  DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Lazy);
+  SmallVector<BasicBlock *, 8> Preds(predecessors(P2));
+  for (BasicBlock *Pred : Preds) {
+    auto *Br = dyn_cast<BranchInst>(Pred->getTerminator());
+    if (!Br || !Br->isConditional())
+      continue;
+    BasicBlock *Next = Br->getSuccessor(0) == P2 ? Br->getSuccessor(1) : Br->getSuccessor(0);
+    Value *Cond = Br->getCondition();
+    P2->removePredecessor(Pred);
+    IRBuilder<> Builder(Br);
+    Builder.CreateBr(Next);
+    Br->eraseFromParent();
+    RecursivelyDeleteTriviallyDeadInstructions(Cond);
+    DTU.applyUpdates({{DominatorTree::Delete, Pred, P2}});
+  }
+  // L'uscita dedicata di L1 e P2 diventano un solo blocco
+  MergeBlockIntoPredecessor(P2, &DTU, &LI);
+  DTU.flush();
+
+  // peelLoop non aggiorna il post dominator tree
+  PDT.recalculate(F);
+  SE.forgetLoop(L1);
+  return true;
+}
+// Continuo della funzione "hasNegativeDistance": date una store di L1 e una load di L2, ne confronta
+// gli indici uno per uno, ricavando le componenti del vettore di distanza sui livelli del nido:
+// - indici uguali: nessun vincolo (stessa cella a ogni iterazione, o loop esterni già fusi);
+// - costanti diverse, o AddRec diverse di uno stesso loop esterno: nella stessa iterazione esterna
+//   le celle non coincidono mai e la fusione non cambia l'ordine degli accessi;
+// - AddRec di L1 e di L2: è la componente del livello da fondere, la distanza fra i valori iniziali
+//   non deve essere negativa (la load leggerebbe una cella che L1 scrive solo più avanti);
+// - AddRec di loop interni allo stesso livello: nel corpo fuso il loop interno di L1 gira tutto
+//   prima di quello di L2, nessun vincolo.
+// In ogni altro caso, o se il livello da fondere non compare negli indici (tutte le sue iterazioni
+// toccano le stesse celle), la distanza si considera negativa.
+// Con Peel > 0 le prime Peel iterazioni di L1 verranno staccate: l'indice della store va
+// confrontato con quello che avrà all'iterazione Peel.
+bool isThereNegativeDistance(StoreInst *Store, LoadInst *Load, Loop *L1, Loop *L2, ScalarEvolution &SE, unsigned Peel){
+  // Ottengo i puntatori delle rispettive store e load: servono due GEP con la stessa base e la stessa forma
+  auto *GEPst = dyn_cast<GetElementPtrInst>(Store->getPointerOperand());
+  auto *GEPld = dyn_cast<GetElementPtrInst>(Load->getPointerOperand());
+  if (!GEPst || !GEPld || GEPst->getPointerOperand() != GEPld->getPointerOperand() ||
+      GEPst->getSourceElementType() != GEPld->getSourceElementType() ||
+      GEPst->getNumOperands() != GEPld->getNumOperands())
+    return true; // Conservativamente dice che la distanza è negativa
+
+  bool LevelFound = false;
+  for (unsigned Idx = 1; Idx < GEPst->getNumOperands(); ++Idx) {
+    const SCEV *S1 = SE.getSCEV(GEPst->getOperand(Idx));
+    const SCEV *S2 = SE.getSCEV(GEPld->getOperand(Idx));
+    if (S1 == S2)
+      continue;
+    if (S1->getType() != S2->getType())
+      return true;
+    if (isa<SCEVConstant>(S1) && isa<SCEVConstant>(S2))
+      return false;
+
+    auto *AR1 = dyn_cast<SCEVAddRecExpr>(S1);
+    auto *AR2 = dyn_cast<SCEVAddRecExpr>(S2);
+    if (!AR1 || !AR2 || !AR1->isAffine() || !AR2->isAffine() ||
+        AR1->getStepRecurrence(SE) != AR2->getStepRecurrence(SE))
+      return true;
+    const Loop *X1 = AR1->getLoop();
+    const Loop *X2 = AR2->getLoop();
+
+    // Loop esterno comune
+    if (X1 == X2)
+      return !isa<SCEVConstant>(SE.getMinusSCEV(S1, S2));
+
+    // Livello da fondere: a parità di passo conta la distanza fra i valori iniziali,
+    // misurata nel verso del passo
+    if (X1 == L1 && X2 == L2) {
+      auto *Step = dyn_cast<SCEVConstant>(AR1->getStepRecurrence(SE));
+      const SCEV *Start1 = AR1->evaluateAtIteration(SE.getConstant(AR1->getType(), Peel), SE);
+      auto *Start = dyn_cast<SCEVConstant>(SE.getMinusSCEV(Start1, AR2->getStart()));
+      if (!Step || !Start)
+        return true;
+      int64_t startVal = Start->getValue()->getSExtValue();
+      if (Step->getValue()->isNegative() ? startVal > 0 : startVal < 0)
+        return true;
+      LevelFound = true;
+      continue;
     }
+
+    // Loop interni allo stesso livello, purché non dipendano dal livello da fondere
+    if (L1->contains(X1) && L2->contains(X2) && X1->getLoopDepth() == X2->getLoopDepth() &&
+        SE.isLoopInvariant(AR1->getStart(), L1) && SE.isLoopInvariant(AR2->getStart(), L2))
+      continue;
+    return true;
   }
-  return true; // Conservativamente dice che la distanza è negativa
+  return !LevelFound;
+}
+// Raggruppa gli accessi del tipo T nei blocchi di L per oggetto sottostante (alloca, global,
+// argomento, ...), nell'ordine in cui gli oggetti compaiono
+template <typename T>
+MapVector<const Value *, SmallVector<T *, 8>> getAccessesByObject(Loop *L) {
+  MapVector<const Value *, SmallVector<T *, 8>> Buckets;
+  for (BasicBlock *BB : L->getBlocks())
+    for (Instruction &I : *BB)
+      if (auto *Access = dyn_cast<T>(&I))
+        Buckets[getUnderlyingObject(Access->getPointerOperand())].push_back(Access);
+  return Buckets;
 }
 // Controlla se la distanza di tutte le istruzioni dei due loop è negativa e se in caso contrario
-// ritorna true. Questa funzione deve essere usata solo se "hasSameTripCount" ha avuto esito positivo.
-bool hasNegativeDistance(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager &AM) {
+// ritorna true. Questa funzione deve essere usata solo se "hasSameTripCount" ha avuto esito positivo
+// oppure, con Peel > 0, se lo avrà dopo aver staccato Peel iterazioni da L1.
+// Le store di L1 e le load di L2 sono raggruppate per oggetto sottostante: due oggetti identificati
+// diversi non possono sovrapporsi, quindi i loro accessi non vengono nemmeno confrontati
+bool hasNegativeDistance(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager &AM, unsigned Peel = 0) {
   ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
   DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
 
-  for(auto &BB1 : L1->getBlocks()){ 
-    if(BB1 == L1->getHeader() || BB1 == L1->getLoopPreheader() || BB1 == L1->getLoopLatch()) // Solo i blocchi del body
-      continue;
+  // Tutti i blocchi dei loop: nei loop ruotati header e latch contengono anche il body
+  auto Stores = getAccessesByObject<StoreInst>(L1);
+  auto Loads = getAccessesByObject<LoadInst>(L2);
+  for (auto &[Obj1, StoreBucket] : Stores) {
+    for (auto &[Obj2, LoadBucket] : Loads) {
+      if (Obj1 != Obj2 && isIdentifiedObject(Obj1) && isIdentifiedObject(Obj2))
+        continue;
+      for (StoreInst *Store : StoreBucket)
+        for (LoadInst *Load : LoadBucket)
+          // Il confronto degli indici costa poco: DependenceAnalysis viene interrogata solo
+          // se la distanza risulta negativa, per confermare che store e load accedono
+          // davvero alla stessa memoria. In quel caso la Loop Fusion non si può fare.
+          if (isThereNegativeDistance(Store, Load, L1, L2, SE, Peel) &&
+              DI.depends(Store, Load, true))
+            return true;
+    }
+  }
+  return false;
+}
+// Esiti di hasNegativeDistance per le coppie candidate e il numero di iterazioni staccate,
+// riusati tra un giro di fusioni e l'altro: un esito resta valido finché nessun loop dei due nidi (né un loop che li contiene)
+// viene staccato o fuso, altrimenti cambiano gli accessi e le loro AddRec
+class DistanceCache {
+  DenseMap<std::tuple<Loop *, Loop *, unsigned>, bool> Results;
+
+public:
+  bool hasNegativeDistance(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager &AM, unsigned Peel) {
+    auto [It, Inserted] = Results.try_emplace({L1, L2, Peel}, false);
+    if (Inserted)
+      It->second = ::hasNegativeDistance(L1, L2, F, AM, Peel);
+    return It->second;
+  }
 
-    for(auto &I1:*BB1){
-      if(isa<StoreInst>(I1)){
-        for(auto &BB2 : L2->getBlocks()){
-          if(BB2 == L2->getHeader() || BB2 == L2->getLoopPreheader() || BB2 == L1->getLoopLatch()) // Solo i blocchi del body
-            continue;
-          
-          for(auto &I2:*BB2){
-            if(isa<LoadInst>(I2)){
-              auto *Store = cast<StoreInst>(&I1);
-              auto *Load = cast<LoadInst>(&I2);
-              auto D = DI.depends(&I1,&I2,true);              // Se le due store e load dipendono tra di loro (ovvero accedono alla stessa memoria)
-              if(D && isThereNegativeDistance(Store,Load,SE)) // allora si può controllare se la loro distanza è negativa, in caso positivo la
-                return true;                                  // Loop Fusion non si può fare.
-            }
-          }          
-        }
+  // Da chiamare prima di staccare iterazioni da L1 o di fondere L1 e L2 (L2 viene poi
+  // cancellato): cambiano gli accessi dei due nidi e quindi anche quelli di ogni loop
+  // che li contiene, le cui coppie con i loro fratelli vanno ricontrollate
+  void invalidate(Loop *L1, Loop *L2) {
+    SmallPtrSet<Loop *, 8> Stale;
+    for (Loop *L : {L1, L2}) {
+      for (Loop *Sub : L->getLoopsInPreorder())
+        Stale.insert(Sub);
+      for (Loop *Parent = L->getParentLoop(); Parent; Parent = Parent->getParentLoop())
+        Stale.insert(Parent);
+    }
+    for (auto It = Results.begin(); It != Results.end(); ++It)
+      if (Stale.count(std::get<0>(It->first)) || Stale.count(std::get<1>(It->first)))
+        Results.erase(It);
+  }
+};
+// Fusione di due loop ruotati (la forma prodotta da clang da -O1 in su). Se sono guarded:
+//   G1 -> P1 -> L1 -> E1 -> G2 -> P2 -> L2 -> E2 -> X2   (G1 e G2 saltano anche a G2 e X2)
+// diventa
+//   G1 -> P1 -> L1 + L2 -> E1 -> E2 -> X2                 (G1 salta anche a X2)
+// Le guardie sono equivalenti (isLoopAdjacent), quindi la seconda sparisce insieme
+// al preheader di L2, il cui contenuto passa nel preheader di L1.
+// Senza guardie l'uscita di L1 è il preheader di L2: P1 -> L1 -> P2 -> L2 -> E2
+// diventa P1 -> L1 + L2 -> E2.
+bool fuseRotatedLoops(std::pair<Loop*, Loop*> LPair, Function &F, FunctionAnalysisManager &AM) {
+  DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+  PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+  LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+  ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+  Loop *L1 = LPair.first;
+  Loop *L2 = LPair.second;
+  bool Guarded = L1->isGuarded();
+
+  BasicBlock *P1 = L1->getLoopPreheader();
+  BasicBlock *P2 = L2->getLoopPreheader();
+  BasicBlock *H1 = L1->getHeader();
+  BasicBlock *H2 = L2->getHeader();
+  BasicBlock *L1Latch = L1->getLoopLatch();
+  BasicBlock *L2Latch = L2->getLoopLatch();
+  BasicBlock *E1 = L1->getExitBlock();
+  BasicBlock *E2 = L2->getExitBlock();
+  if (!E1 || !E2)
+    return false;
+
+  // Loop ruotati: si esce solo dal latch
+  if (L1->getExitingBlock() != L1Latch || L2->getExitingBlock() != L2Latch)
+    return false;
+  auto *L1LatchBr = dyn_cast<BranchInst>(L1Latch->getTerminator());
+  auto *L2LatchBr = dyn_cast<BranchInst>(L2Latch->getTerminator());
+  if (!L1LatchBr || !L2LatchBr)
+    return false;
+  std::pair<PHINode*, PHINode*> IVs = getAlignedIVs(L1, L2, SE);
+  if (!IVs.first)
+    return false;
+
+  BranchInst *L1Guard = nullptr, *L2Guard = nullptr;
+  BasicBlock *G1 = nullptr, *G2 = nullptr, *X2 = nullptr, *ExitTail = nullptr, *E2Tail = nullptr;
+  Instruction *G2Cond = nullptr;
+  if (Guarded) {
+    L1Guard = L1->getLoopGuardBranch();
+    L2Guard = L2->getLoopGuardBranch();
+    G1 = L1Guard->getParent();
+    G2 = L2Guard->getParent();
+    // L'altro ramo della seconda guardia
+    X2 = L2Guard->getSuccessor(0) == P2 ? L2Guard->getSuccessor(1) : L2Guard->getSuccessor(0);
+
+    // Da E1 si deve arrivare a G2 con una catena di blocchi vuoti (al più phi LCSSA),
+    // altrimenti ci sarebbe codice da eseguire fra i due loop
+    ExitTail = E1;
+    while (ExitTail->getUniqueSuccessor() != G2) {
+      ExitTail = ExitTail->getUniqueSuccessor();
+      if (!ExitTail || !ExitTail->getSinglePredecessor())
+        return false;
+    }
+    for (BasicBlock *BB = E1;; BB = BB->getUniqueSuccessor()) {
+      if (BB->getFirstNonPHI() != BB->getTerminator())
+        return false;
+      if (BB == ExitTail)
+        break;
+    }
+
+    // Lo stesso dal lato di L2: E2Tail è il blocco che arriva in X2
+    E2Tail = E2;
+    while (E2Tail->getUniqueSuccessor() != X2) {
+      E2Tail = E2Tail->getUniqueSuccessor();
+      if (!E2Tail || !E2Tail->getSinglePredecessor())
+        return false;
+    }
+
+    // G2 può contenere solo la condizione della guardia e delle phi che uniscono i valori
+    // prodotti prima di L2: queste scendono in X2, quindi i loro usi devono stare sotto X2
+    if (!G2->hasNPredecessors(2))
+      return false;
+    G2Cond = dyn_cast<Instruction>(L2Guard->getCondition());
+    for (Instruction &I : *G2) {
+      auto *PN = dyn_cast<PHINode>(&I);
+      if (!PN) {
+        if (&I != L2Guard && &I != G2Cond)
+          return false;
+        continue;
+      }
+      if (!X2->hasNPredecessors(2))
+        return false;
+      for (Use &U : PN->uses()) {
+        auto *UI = cast<Instruction>(U.getUser());
+        auto *UsePN = dyn_cast<PHINode>(UI);
+        if (!DT.dominates(X2, UsePN ? UsePN->getIncomingBlock(U) : UI->getParent()))
+          return false;
       }
     }
+  } else if (E1 != P2 || isa<PHINode>(P2->front())) {
+    // Senza guardie P2 è anche l'uscita di L1: le sue phi LCSSA non avrebbero più un posto
+    return false;
   }
-  return false;
+
+  // Il preheader di L2 finisce prima di L1: vale solo per istruzioni che non toccano la memoria
+  for (Instruction &I : *P2)
+    if (&I != P2->getTerminator() && (I.mayReadOrWriteMemory() || I.mayHaveSideEffects()))
+      return false;
+
+  // SCEV non deve conservare informazioni sui due loop che stanno per cambiare
+  SE.forgetLoop(L1);
+  SE.forgetLoop(L2);
+
+  // La seconda guardia è uguale alla prima
+  if (G2Cond && G2Cond->getParent() == G2)
+    G2Cond->replaceAllUsesWith(L1Guard->getCondition());
+
+  // Sostituzione variabile d’induzione
+  IVs.second->replaceAllUsesWith(IVs.first);
+  IVs.second->eraseFromParent();
+
+  // Il preheader di L2 confluisce in quello di L1, le altre phi di H2 (ad es. riduzioni) in H1
+  while (P2->getFirstNonPHI() != P2->getTerminator())
+    P2->getFirstNonPHI()->moveBefore(P1->getTerminator());
+  while (auto *PN = dyn_cast<PHINode>(&H2->front())) {
+    PN->moveBefore(H1->getFirstNonPHI());
+    PN->replaceIncomingBlockWith(P2, P1);
+  }
+
+  // Fusione L1 latch con L2 header: il controllo d'uscita resta solo a fine L2
+  Value *L1LatchCond = L1LatchBr->isConditional() ? L1LatchBr->getCondition() : nullptr;
+  IRBuilder<> Builder(L1LatchBr);
+  Builder.CreateBr(H2);
+  L1LatchBr->eraseFromParent();
+  if (L1LatchCond)
+    RecursivelyDeleteTriviallyDeadInstructions(L1LatchCond);
+
+  // Fusione L2 latch con L1 header (e, se guarded, con l'uscita di L1)
+  for (unsigned i = 0; i < L2LatchBr->getNumSuccessors(); ++i)
+    if (L2LatchBr->getSuccessor(i) == H2)
+      L2LatchBr->setSuccessor(i, H1);
+    else if (Guarded)
+      L2LatchBr->setSuccessor(i, E1);
+  for (PHINode &PN : H1->phis())
+    PN.replaceIncomingBlockWith(L1Latch, L2Latch);
+
+  DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+  DTU.applyUpdates({{DominatorTree::Delete, L1Latch, H1},
+                    {DominatorTree::Delete, L1Latch, E1},
+                    {DominatorTree::Insert, L1Latch, H2},
+                    {DominatorTree::Delete, L2Latch, H2},
+                    {DominatorTree::Insert, L2Latch, H1}});
+
+  if (Guarded) {
+    for (PHINode &PN : E1->phis())
+      PN.replaceIncomingBlockWith(L1Latch, L2Latch);
+
+    // Le uscite vengono concatenate: E1 -> ... -> E2 -> X2. Le phi LCSSA di E2 salgono in E1,
+    // che è ora l'unica uscita dal latch: con E2 vuoto il loop fuso resta riconosciuto come
+    // guarded (getLoopGuardBranch salta solo blocchi vuoti) e può fondersi col successivo
+    ExitTail->getTerminator()->replaceUsesOfWith(G2, E2);
+    while (auto *PN = dyn_cast<PHINode>(&E2->front()))
+      PN->moveBefore(E1->getFirstNonPHI());
+
+    // La prima guardia salta direttamente dove saltava la seconda, che viene staccata da X2
+    L1Guard->replaceUsesOfWith(G2, X2);
+    L2Guard->replaceUsesOfWith(X2, P2);
+    for (PHINode &PN : X2->phis())
+      PN.replaceIncomingBlockWith(G2, G1);
+    while (auto *PN = dyn_cast<PHINode>(&G2->front())) {
+      PN->moveBefore(X2->getFirstNonPHI());
+      PN->replaceIncomingBlockWith(ExitTail, E2Tail);
+    }
+
+    DTU.applyUpdates({{DominatorTree::Delete, L2Latch, E2},
+                      {DominatorTree::Insert, L2Latch, E1},
+                      {DominatorTree::Delete, ExitTail, G2},
+                      {DominatorTree::Insert, ExitTail, E2},
+                      {DominatorTree::Delete, G1, G2},
+                      {DominatorTree::Insert, G1, X2},
+                      {DominatorTree::Delete, G2, X2}});
+  }
+
+  // LoopInfo: seconda guardia e preheader spariscono, tutto il corpo di L2 passa a L1
+  SmallVector<BasicBlock *, 2> DeadBlocks;
+  if (Guarded)
+    DeadBlocks.push_back(G2);
+  DeadBlocks.push_back(P2);
+  for (BasicBlock *BB : DeadBlocks)
+    LI.removeBlock(BB);
+  SmallVector<BasicBlock *, 8> L2Blocks(L2->blocks());
+  for (BasicBlock *BB : L2Blocks) {
+    L1->addBlockEntry(BB);
+    L2->removeBlockFromLoop(BB);
+    if (LI.getLoopFor(BB) == L2)
+      LI.changeLoopFor(BB, L1);
+  }
+  while (!L2->isInnermost())
+    L1->addChildLoop(L2->removeChildLoop(L2->begin()));
+  LI.erase(L2);
+
+  DeleteDeadBlocks(DeadBlocks, &DTU);
+  // Il corpo di L2 prosegue direttamente quello di L1: in un nido così l'uscita del loop
+  // interno di L1 diventa il preheader di quello di L2 e i due sono adiacenti
+  MergeBlockIntoPredecessor(H2, &DTU, &LI);
+  DTU.flush();
+  return true;
 }
-// Fusione dei due loop: Questa funzione si occupa solamente di fusioni fra due cicli for non guarded
-// con definizioni di variabili dead after loop.
-void fuseLoops(std::pair<Loop*, Loop*> LPair, Function &F) {
+// Fusione dei due loop: Questa funzione si occupa direttamente di fusioni fra due cicli for non guarded
+// con definizioni di variabili dead after loop, i loop ruotati passano da fuseRotatedLoops.
+// Le analisi vengono aggiornate sul posto: DT e PDT tramite DomTreeUpdater, LoopInfo
+// spostando il corpo di L2 in L1 e cancellando L2, SCEV dimenticando i due loop
+bool fuseLoops(std::pair<Loop*, Loop*> LPair, Function &F, FunctionAnalysisManager &AM) {
+  // isLoopAdjacent accetta solo coppie entrambe guarded o entrambe non guarded
+  if (LPair.first->isGuarded() || LPair.first->getExitingBlock() == LPair.first->getLoopLatch())
+    return fuseRotatedLoops(LPair, F, AM);
+
+  DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+  PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+  LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+  ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
   Loop *L1 = LPair.first;
   Loop *L2 = LPair.second;
 
@@ -233,7 +609,7 @@ void fuseLoops(std::pair<Loop*, Loop*> LPair, Function &F) {
   BasicBlock *L2Latch = L2->getLoopLatch();
   BasicBlock *L2Exit = L2->getExitBlock();
   if (!L2Exit)
-    return;
+    return false;
 
   BasicBlock *L1BodyStart = nullptr;
   for (auto *Succ : successors(L1Header)) {
@@ -255,56 +631,329 @@ void fuseLoops(std::pair<Loop*, Loop*> LPair, Function &F) {
 
   // Ottengo tutte le entrate e uscite dal body
   if (!L1BodyStart || !L1BodyEnd || !L2BodyStart || !L2BodyEnd)
-    return;
+    return false;
+
+  // Ottengo i terminatori utili: vanno controllati tutti prima di toccare il CFG
+  auto *L1BrBodyExit = dyn_cast<BranchInst>(L1BodyEnd->getTerminator());
+  auto *L1BrHeader = dyn_cast<BranchInst>(L1Header->getTerminator());
+  auto *L2BrBodyExit = dyn_cast<BranchInst>(L2BodyEnd->getTerminator());
+  if (!L1BrBodyExit || !L1BrHeader || !L2BrBodyExit)
+    return false;
+  // Si esce dall'header di L1 tramite il suo secondo successore (loop non ruotato)
+  if (!L1BrHeader->isConditional() || L1->contains(L1BrHeader->getSuccessor(1)))
+    return false;
 
-  // Ottengo i terminatori utili
-  Instruction *L1BrBodyExit = L1BodyEnd->getTerminator();
-  Instruction *L1BrHeader = L1Header->getTerminator();
-  Instruction *L2BrBodyExit = L2BodyEnd->getTerminator();
-  Instruction *L2BrHeader = L2Header->getTerminator();
+  // L'header di L2 viene cancellato: l'unica phi ammessa è la variabile d'induzione
+  std::pair<PHINode*, PHINode*> IVs = getAlignedIVs(L1, L2, SE);
+  if (!IVs.first || &L2Header->front() != IVs.second || L2Header->getFirstNonPHI() != IVs.second->getNextNode())
+    return false;
+
+  // SCEV non deve conservare informazioni sui due loop che stanno per cambiare
+  SE.forgetLoop(L1);
+  SE.forgetLoop(L2);
 
   // Sostituzione variabile d’induzione
-  L2->getCanonicalInductionVariable()->replaceAllUsesWith(L1->getCanonicalInductionVariable());
+  IVs.second->replaceAllUsesWith(IVs.first);
 
   // Fusione L1 body con L2 body
-  if (auto *Br = dyn_cast<BranchInst>(L1BrBodyExit)) {
-    L1BrBodyExit->setSuccessor(0, L2BodyStart);
-  } else return;
-
+  L1BrBodyExit->setSuccessor(0, L2BodyStart);
   // Fusione L2 body con L1 latch
-  if (auto *Br = dyn_cast<BranchInst>(L2BrBodyExit)) {
-    L2BrBodyExit->setSuccessor(0, L1Latch);
-  } else return;
-
-  // Fusione L1 header con L2 exit
-  if (auto *Br = dyn_cast<BranchInst>(L1BrHeader)) {
-    Br->setSuccessor(1, L2Exit);
-  } else return;
-
-  // Fusione L2 header con L2 latch
-  if (auto *Br = dyn_cast<BranchInst>(L2BrHeader)) {
-    Br->setSuccessor(0, L2Latch);
-  } else return;
-
-  // Pulizia codice
-  L2Preheader->eraseFromParent();
-  L2Header->eraseFromParent();
-  L2Latch->eraseFromParent();
+  L2BrBodyExit->setSuccessor(0, L1Latch);
+  // Fusione L1 header con L2 exit: le phi dell'uscita ricevono da L1 header
+  // quello che ricevevano da L2 header
+  L1BrHeader->setSuccessor(1, L2Exit);
+  for (PHINode &PN : L2Exit->phis())
+    PN.addIncoming(PN.getIncomingValueForBlock(L2Header), L1Header);
+
+  DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+  DTU.applyUpdates({{DominatorTree::Delete, L1BodyEnd, L1Latch},
+                    {DominatorTree::Insert, L1BodyEnd, L2BodyStart},
+                    {DominatorTree::Delete, L2BodyEnd, L2Latch},
+                    {DominatorTree::Insert, L2BodyEnd, L1Latch},
+                    {DominatorTree::Delete, L1Header, L2Preheader},
+                    {DominatorTree::Insert, L1Header, L2Exit}});
+
+  // LoopInfo: preheader, header e latch di L2 spariscono, il resto passa a L1
+  LI.removeBlock(L2Preheader);
+  LI.removeBlock(L2Header);
+  LI.removeBlock(L2Latch);
+  SmallVector<BasicBlock *, 8> L2Blocks(L2->blocks());
+  for (BasicBlock *BB : L2Blocks) {
+    L1->addBlockEntry(BB);
+    L2->removeBlockFromLoop(BB);
+    if (LI.getLoopFor(BB) == L2)
+      LI.changeLoopFor(BB, L1);
+  }
+  while (!L2->isInnermost())
+    L1->addChildLoop(L2->removeChildLoop(L2->begin()));
+  LI.erase(L2);
+
+  // Pulizia codice: i tre blocchi non sono più raggiungibili
+  DeleteDeadBlocks({L2Preheader, L2Header, L2Latch}, &DTU);
+  // Come per i loop ruotati: in un nido i loop interni diventano adiacenti
+  MergeBlockIntoPredecessor(L2BodyStart, &DTU, &LI);
+  DTU.flush();
+  return true;
+}
+// Oltre questo numero di flussi di memoria distinti i prefetcher hardware non riescono a
+// seguirli tutti: se la fusione non riusa nessun flusso, ne paga solo il costo
+const unsigned MaxMemoryStreams = 16;
+
+// Stima delle risorse usate da un loop innermost
+struct LoopCost {
+  unsigned LoopCarried = 0;                // phi dell'header, vivi per tutto il corpo
+  SmallPtrSet<Value *, 16> LiveIns;        // valori definiti fuori dal loop e usati dentro
+  SmallPtrSet<const Value *, 16> Streams;  // oggetti sottostanti alle load e alle store
+  bool Vectorizable = true;                // stima: solo induzioni, riduzioni e accessi semplici
+};
+
+LoopCost getLoopCost(Loop *L, ScalarEvolution &SE) {
+  LoopCost C;
+  for (PHINode &Phi : L->getHeader()->phis()) {
+    ++C.LoopCarried;
+    InductionDescriptor ID;
+    RecurrenceDescriptor RD;
+    if (!InductionDescriptor::isInductionPHI(&Phi, L, &SE, ID) &&
+        !RecurrenceDescriptor::isReductionPHI(&Phi, L, RD))
+      C.Vectorizable = false;
+  }
+  for (BasicBlock *BB : L->getBlocks()) {
+    for (Instruction &I : *BB) {
+      for (Value *Op : I.operands())
+        if (isa<Argument>(Op) || (isa<Instruction>(Op) && !L->contains(cast<Instruction>(Op))))
+          C.LiveIns.insert(Op);
+
+      if (auto *Load = dyn_cast<LoadInst>(&I)) {
+        C.Streams.insert(getUnderlyingObject(Load->getPointerOperand()));
+        C.Vectorizable &= Load->isSimple();
+      } else if (auto *Store = dyn_cast<StoreInst>(&I)) {
+        C.Streams.insert(getUnderlyingObject(Store->getPointerOperand()));
+        C.Vectorizable &= Store->isSimple();
+      } else if (I.mayReadOrWriteMemory() || (isa<CallBase>(I) && !isa<IntrinsicInst>(I))) {
+        // chiamate e accessi atomici: il vectorizer non li gestisce
+        C.Vectorizable = false;
+      }
+    }
+  }
+  return C;
+}
+// Controlla che la fusione di L1 e L2 non sia più lenta dei due loop separati. Rifiuta la fusione se:
+// - il corpo fuso ha più valori vivi dei registri disponibili, mentre i due corpi separati no (spill);
+// - solo uno dei due loop è vettorizzabile: il loop fuso non lo sarebbe più;
+// - il corpo fuso scorre troppi flussi di memoria senza che i due loop ne condividano nessuno.
+// La fusione di loop esterni mette solo uno dopo l'altro i loop interni e non cambia nessuna
+// di queste stime: i loop interni vengono valutati a loro volta quando diventano candidati.
+// La decisione viene riportata come optimization remark (-pass-remarks-missed=lofu)
+bool isFusionProfitable(Loop *L1, Loop *L2, Function &F, FunctionAnalysisManager &AM) {
+  if (!L1->isInnermost() || !L2->isInnermost())
+    return true;
+  ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+  TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+  OptimizationRemarkEmitter &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+  LoopCost C1 = getLoopCost(L1, SE);
+  LoopCost C2 = getLoopCost(L2, SE);
+
+  unsigned Registers = TTI.getNumberOfRegisters(TTI.getRegisterClassForType(false));
+  unsigned Live1 = C1.LoopCarried + C1.LiveIns.size();
+  unsigned Live2 = C2.LoopCarried + C2.LiveIns.size();
+  SmallPtrSet<Value *, 16> LiveIns = C1.LiveIns;
+  LiveIns.insert(C2.LiveIns.begin(), C2.LiveIns.end());
+  // l'induzione di L2 viene sostituita da quella di L1
+  unsigned FusedLive = C1.LoopCarried + C2.LoopCarried - 1 + LiveIns.size();
+
+  SmallPtrSet<const Value *, 16> Streams = C1.Streams;
+  Streams.insert(C2.Streams.begin(), C2.Streams.end());
+  unsigned SharedStreams = C1.Streams.size() + C2.Streams.size() - Streams.size();
+
+  StringRef Reason;
+  if (FusedLive > Registers && Live1 <= Registers && Live2 <= Registers)
+    Reason = "il corpo fuso ha più valori vivi dei registri disponibili";
+  else if (C1.Vectorizable != C2.Vectorizable)
+    Reason = "solo uno dei due loop è vettorizzabile";
+  else if (Streams.size() > MaxMemoryStreams && !SharedStreams)
+    Reason = "troppi flussi di memoria senza riuso";
+  if (Reason.empty())
+    return true;
+
+  ORE.emit([&]() {
+    return OptimizationRemarkMissed("lofu", "NotProfitable", L1->getStartLoc(), L1->getHeader())
+           << "fusione non conveniente: " << Reason << " (valori vivi "
+           << ore::NV("LiveValues", FusedLive) << " su " << ore::NV("Registers", Registers)
+           << " registri, " << ore::NV("MemoryStreams", (unsigned)Streams.size())
+           << " flussi di memoria di cui " << ore::NV("SharedStreams", SharedStreams)
+           << " condivisi)";
+  });
+  return false;
 }
-// Generico passo di Loop Fusion NON iterativo (itera solamente una volta)
+// Elimina un array locale di cui restano solo scritture (nessuna load, nessun uso del puntatore
+// fuori da GEP, store e lifetime marker): le store, i GEP e l'alloca non servono più
+bool removeWriteOnlyAlloca(AllocaInst *Alloca) {
+  SmallVector<Instruction *, 16> Worklist = {Alloca};
+  SmallVector<Instruction *, 16> Writes;
+  SmallVector<WeakTrackingVH, 16> DeadInsts;
+  while (!Worklist.empty()) {
+    Instruction *Ptr = Worklist.pop_back_val();
+    DeadInsts.push_back(Ptr);
+    for (User *U : Ptr->users()) {
+      auto *I = cast<Instruction>(U);
+      if (isa<GetElementPtrInst>(I) || isa<BitCastInst>(I))
+        Worklist.push_back(I);
+      else if (auto *Store = dyn_cast<StoreInst>(I); Store && Store->getPointerOperand() == Ptr &&
+                                                    !Store->isVolatile())
+        Writes.push_back(Store);
+      else if (auto *II = dyn_cast<IntrinsicInst>(I); II && II->isLifetimeStartOrEnd())
+        Writes.push_back(II);
+      else
+        return false; // letto o sfuggito
+    }
+  }
+  for (Instruction *I : Writes) {
+    if (auto *Store = dyn_cast<StoreInst>(I))
+      DeadInsts.push_back(Store->getValueOperand());
+    I->eraseFromParent();
+  }
+  // dai GEP più interni all'alloca, insieme ai calcoli rimasti senza usi
+  std::reverse(DeadInsts.begin(), DeadInsts.end());
+  RecursivelyDeleteTriviallyDeadInstructionsPermissive(DeadInsts);
+  return true;
+}
+// Array contraction dopo la fusione: nel corpo fuso L2 legge nella stessa iterazione la cella
+// che L1 ha appena scritto (tmp[i] = ...; ... = tmp[i]). La load viene sostituita dal valore
+// della store, se la store la domina, l'indirizzo ha lo stesso SCEV e nessun'altra scrittura
+// del loop può toccare quella cella. Se l'array è un'alloca che non viene più letta, sparisce
+// del tutto insieme alle sue store.
+bool contractArrays(Loop *L, Function &F, FunctionAnalysisManager &AM) {
+  ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+  DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+  LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+  AAResults &AA = AM.getResult<AAManager>(F);
+
+  // store indicizzate per indirizzo e scritture raggruppate per oggetto sottostante
+  // (nullptr per le chiamate), come in hasNegativeDistance
+  DenseMap<const SCEV *, SmallVector<StoreInst *, 2>> Stores;
+  SmallVector<LoadInst *, 8> Loads;
+  MapVector<const Value *, SmallVector<Instruction *, 8>> Writes;
+  for (BasicBlock *BB : L->getBlocks()) {
+    for (Instruction &I : *BB) {
+      if (auto *Store = dyn_cast<StoreInst>(&I); Store && Store->isSimple())
+        Stores[SE.getSCEV(Store->getPointerOperand())].push_back(Store);
+      else if (auto *Load = dyn_cast<LoadInst>(&I); Load && Load->isSimple())
+        Loads.push_back(Load);
+      if (auto *Store = dyn_cast<StoreInst>(&I))
+        Writes[getUnderlyingObject(Store->getPointerOperand())].push_back(Store);
+      else if (I.mayWriteToMemory())
+        Writes[nullptr].push_back(&I);
+    }
+  }
+  // una scrittura diversa da Store che può modificare la cella letta da Load
+  auto isClobbered = [&](LoadInst *Load, StoreInst *Store) {
+    const Value *Obj = getUnderlyingObject(Load->getPointerOperand());
+    MemoryLocation Loc = MemoryLocation::get(Load);
+    for (auto &[WObj, Bucket] : Writes) {
+      if (WObj && WObj != Obj && isIdentifiedObject(WObj) && isIdentifiedObject(Obj))
+        continue;
+      if (any_of(Bucket, [&](Instruction *W) {
+            return W != Store && isModSet(AA.getModRefInfo(W, Loc));
+          }))
+        return true;
+    }
+    return false;
+  };
+
+  bool Changed = false;
+  SmallSetVector<AllocaInst *, 4> Contracted;
+  SmallVector<WeakTrackingVH, 8> DeadInsts;
+  for (LoadInst *Load : Loads) {
+    auto It = Stores.find(SE.getSCEV(Load->getPointerOperand()));
+    if (It == Stores.end())
+      continue;
+    for (StoreInst *Store : It->second) {
+      if (Store->getValueOperand()->getType() != Load->getType() ||
+          LI.getLoopFor(Store->getParent()) != LI.getLoopFor(Load->getParent()) ||
+          !DT.dominates(Store, Load))
+        continue;
+      if (isClobbered(Load, Store))
+        break;
+      Load->replaceAllUsesWith(Store->getValueOperand());
+      DeadInsts.push_back(Load->getPointerOperand());
+      Load->eraseFromParent();
+      if (auto *Alloca = dyn_cast<AllocaInst>(getUnderlyingObject(Store->getPointerOperand())))
+        Contracted.insert(Alloca);
+      Changed = true;
+      break;
+    }
+  }
+  // gli indirizzi delle load eliminate, solo a scansione finita
+  RecursivelyDeleteTriviallyDeadInstructionsPermissive(DeadInsts);
+  for (AllocaInst *Alloca : Contracted)
+    removeWriteOnlyAlloca(Alloca);
+  return Changed;
+}
+// Un giro di fusioni: ogni coppia candidata che supera i controlli viene fusa.
+// Le coppie possono condividere un loop: una volta fuso, un loop non viene più toccato
+// in questo giro (il secondo è già stato cancellato) e il loop fuso torna candidato al giro dopo
+bool fuseCandidates(Function &F, FunctionAnalysisManager &AM, DistanceCache &Cache) {
+  OptimizationRemarkEmitter &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+  bool Changed = false;
+  SmallPtrSet<Loop *, 8> Fused;
+  for (auto &L : getLoopCandidates(F, AM)) {
+    if (Fused.count(L.first) || Fused.count(L.second))
+      continue;
+    // Con trip count diversi si prova ad allineare i loop staccando iterazioni dall'inizio di L1
+    bool SameTripCount = haveSameTripCount(L.first, L.second, F, AM);
+    unsigned Peel = SameTripCount ? 0 : getPeelCount(L.first, L.second, F, AM);
+    if (!SameTripCount && !Peel)
+      continue;
+    if (Cache.hasNegativeDistance(L.first, L.second, F, AM, Peel))
+      continue;
+    if (!isFusionProfitable(L.first, L.second, F, AM))
+      continue;
+    if (Peel) {
+      Cache.invalidate(L.first, L.second);
+      if (!peelFirstLoop(L.first, L.second, Peel, F, AM))
+        continue;
+      // il codice è cambiato anche se la fusione non dovesse riuscire
+      Fused.insert(L.first);
+      Fused.insert(L.second);
+      Changed = true;
+    }
+    DebugLoc Loc = L.first->getStartLoc();
+    // vale anche per l'array contraction che segue la fusione
+    Cache.invalidate(L.first, L.second);
+    if (fuseLoops(L, F, AM)) {
+      Fused.insert(L.first);
+      Fused.insert(L.second);
+      Changed = true;
+      ORE.emit([&]() {
+        return OptimizationRemark("lofu", "Fused", Loc, L.first->getHeader())
+               << "loop fuso con il loop successivo";
+      });
+      contractArrays(L.first, F, AM);
+    }
+  }
+  return Changed;
+}
+// Generico passo di Loop Fusion iterativo: i giri si ripetono fino al punto fisso,
+// così una catena di N loop compatibili collassa in un solo loop (il loop fuso
+// diventa adiacente al successivo della catena e viene ripreso al giro dopo)
 struct TestPass: PassInfoMixin<TestPass> {
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
-    std::set<std::pair<Loop*,Loop*>> LI = getLoopCandidates(F,AM);
     bool anyChanges = false;
-
-    for(auto &L : LI){
-      if(haveSameTripCount(L.first,L.second,F,AM) && !hasNegativeDistance(L.first,L.second,F,AM)){
-        fuseLoops(L,F);
-        anyChanges = true;
-      } 
-    }
-  	if(anyChanges) return PreservedAnalyses::none();
-    else return PreservedAnalyses::all();
+    DistanceCache Cache;
+    while (fuseCandidates(F, AM, Cache))
+      anyChanges = true;
+
+    if (!anyChanges)
+      return PreservedAnalyses::all();
+
+    // fuseLoops aggiorna sul posto DT, PDT, LoopInfo e SCEV
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<PostDominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    PA.preserve<ScalarEvolutionAnalysis>();
+    return PA;
   }
   static bool isRequired() { return true; }
 };
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+# Genera un kernel per misurare il controllo delle dipendenze di LoopFusion:
+# catene di loop con centinaia di load e store su array globali distinti.
+#
+#   python3 gen_memops.py [N] [LOOPS] > memops.ll
+#   opt -load-pass-plugin=<path-to>libLoFu.so -passes=lofu -disable-output \
+#     -time-passes memops.ll
+#
+# In @streams ogni loop scrive N array che il successivo rilegge alla stessa
+# iterazione: la catena si fonde tutta. In @blocked ogni loop legge la cella
+# che il precedente scrive all'iterazione dopo (distanza negativa): nessuna
+# coppia si può fondere, ma viene ricontrollata a ogni giro del punto fisso
+# finché le coppie in coda (su altri array) continuano a fondersi.
+import sys
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+LOOPS = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+TRIP = 1000
+
+out = []
+for k in range(N):
+    out.append(f"@G{k} = global [{TRIP + 1} x i32] zeroinitializer")
+for k in range(N):
+    out.append(f"@H{k} = global [{TRIP + 1} x i32] zeroinitializer")
+
+
+def loop(name, prev, nxt, body):
+    out.append(f"{name}:")
+    out.append(f"  %{name}.i = phi i64 [ 0, %{prev} ], [ %{name}.ni, %{name} ]")
+    out.append(f"  %{name}.i1 = add nuw nsw i64 %{name}.i, 1")
+    out.extend(body(name))
+    out.append(f"  %{name}.ni = add nuw nsw i64 %{name}.i, 1")
+    out.append(f"  %{name}.c = icmp slt i64 %{name}.ni, {TRIP}")
+    out.append(f"  br i1 %{name}.c, label %{name}, label %{name}.exit")
+    out.append(f"{name}.exit:")
+    out.append(f"  br label %{nxt}")
+
+
+def accesses(arr, load_off, store):
+    def body(name):
+        lines = []
+        for k in range(N):
+            ty = f"[{TRIP + 1} x i32]"
+            if load_off is not None:
+                idx = f"%{name}.i1" if load_off else f"%{name}.i"
+                lines.append(f"  %{name}.lp{k} = getelementptr {ty}, ptr @{arr}{k}, i64 0, i64 {idx}")
+                lines.append(f"  %{name}.v{k} = load i32, ptr %{name}.lp{k}")
+            if store:
+                val = f"%{name}.v{k}" if load_off is not None else "1"
+                lines.append(f"  %{name}.sp{k} = getelementptr {ty}, ptr @{arr}{k}, i64 0, i64 %{name}.i")
+                lines.append(f"  store i32 {val}, ptr %{name}.sp{k}")
+        return lines
+    return body
+
+
+def function(fname, kinds):
+    out.append(f"define void @{fname}() {{")
+    out.append("entry:")
+    names = [f"l{j}" for j in range(len(kinds))]
+    out.append(f"  br label %{names[0]}")
+    for j, (name, kind) in enumerate(zip(names, kinds)):
+        prev = "entry" if j == 0 else f"{names[j - 1]}.exit"
+        nxt = names[j + 1] if j + 1 < len(names) else "done"
+        loop(name, prev, nxt, accesses(*kind))
+    out.append("done:")
+    out.append("  ret void")
+    out.append("}")
+
+
+# store, poi load+store alla stessa iterazione
+function("streams", [("G", None, True)] + [("G", 0, True)] * (LOOPS - 1))
+# store, poi load all'iterazione dopo; in coda una catena che si fonde
+function("blocked", [("G", None, True)] + [("G", 1, True)] * (LOOPS - 1) +
+         [("H", None, True)] + [("H", 0, True)] * (LOOPS - 1))
+print("\n".join(out))